@@ -5,45 +5,285 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 
 #include <bytes.h>
-#include <chacha.h>
-#include <poly1305.h>
-#include <aead.h>
+
+#include <sys/aead.h>
 
 /* Conforms to RFC 7539 and 7905. */
 
-static void aead_mac(uint8_t *out, const uint8_t* otk, const void *msg,
-		     int mlen, const void *aad, int alen)
+/*
+ * The msg is ciphered and authenticated in chunks of this many bytes, so
+ * that each chunk is still in L1 for the second pass. 8 blocks, so that
+ * the widest path of chacha20_enc gets whole chunks.
+ */
+#define AEAD_CHUNK_LEN			512
+
+static const uint8_t aead_zeros[16];
+
+void aead_init(struct aead_ctx *ctx, const uint8_t *key,
+	       const uint8_t *nonce, int enc)
+{
+	uint8_t otk[32];
+	struct aead *c;
+
+	assert(ctx);
+	assert(key);
+	assert(nonce);
+
+	assert(sizeof(*c) == sizeof(*ctx));
+	c = (struct aead *)ctx;
+
+	/* Generate the one time key for mac. */
+	memset(otk, 0, sizeof(otk));
+	chacha20_init(&c->chacha, key, nonce, 0);
+	chacha20_enc(&c->chacha, otk, otk, 32);
+	poly1305_init(&c->poly, otk);
+	memset(otk, 0, sizeof(otk));
+
+	chacha20_init(&c->chacha, key, nonce, 1);
+	c->alen = 0;
+	c->mlen = 0;
+	c->enc = enc;
+	c->in_msg = 0;
+}
+
+void aead_update_aad(struct aead_ctx *ctx, const void *aad, int alen)
+{
+	struct aead *c;
+
+	assert(ctx);
+	assert(alen >= 0);
+	c = (struct aead *)ctx;
+	assert(!c->in_msg);
+
+	poly1305_update(&c->poly, aad, alen);
+	c->alen += alen;
+}
+
+/* Pad what has been fed to poly so far (aad, or msg) to 16 bytes. */
+static void aead_pad(struct aead *c, uint64_t len)
+{
+	if (len & 0xf)
+		poly1305_update(&c->poly, aead_zeros, 16 - (len & 0xf));
+}
+
+void aead_update(struct aead_ctx *ctx, void *out, const void *in, int len)
+{
+	int n;
+	uint8_t *q;
+	const uint8_t *p;
+	struct aead *c;
+
+	assert(ctx);
+	assert(len >= 0);
+	c = (struct aead *)ctx;
+
+	if (!c->in_msg) {
+		aead_pad(c, c->alen);
+		c->in_msg = 1;
+	}
+
+	/*
+	 * The mac is over the ciphertext. Decryption macs each chunk before
+	 * it is overwritten, so that out may be in.
+	 */
+	p = in;
+	q = out;
+	for (; len; len -= n, p += n, q += n) {
+		n = len < AEAD_CHUNK_LEN ? len : AEAD_CHUNK_LEN;
+		if (c->enc) {
+			chacha20_enc(&c->chacha, q, p, n);
+			poly1305_update(&c->poly, q, n);
+		} else {
+			poly1305_update(&c->poly, p, n);
+			chacha20_dec(&c->chacha, q, p, n);
+		}
+		c->mlen += n;
+	}
+}
+
+void aead_final(struct aead_ctx *ctx, uint8_t *tag)
 {
-	int pad;
-	struct poly1305_ctx ctx;
-	static const uint8_t z[16] = {0};
 	uint64_t v;
+	struct aead *c;
+
+	assert(ctx);
+	assert(tag);
+	c = (struct aead *)ctx;
+
+	if (!c->in_msg)
+		aead_pad(c, c->alen);
+	aead_pad(c, c->mlen);
+	v = htole64(c->alen);
+	poly1305_update(&c->poly, &v, sizeof(v));
+	v = htole64(c->mlen);
+	poly1305_update(&c->poly, &v, sizeof(v));
+	poly1305_final(&c->poly, tag);
+	memset(c, 0, sizeof(*c));
+}
 
-	poly1305_init(&ctx, otk);
-	poly1305_update(&ctx, aad, alen);
-	pad = 16 - (alen & 0xf);
-	if (pad != 16)
-		poly1305_update(&ctx, z, pad);
-	poly1305_update(&ctx, msg, mlen);
-	pad = 16 - (mlen & 0xf);
-	if (pad != 16)
-		poly1305_update(&ctx, z, pad);
-	v = htole64(alen);
-	poly1305_update(&ctx, &v, sizeof(v));
-	v = htole64(mlen);
-	poly1305_update(&ctx, &v, sizeof(v));
-	poly1305_final(&ctx, out);
+/* 1 if the tag matches. Constant-time compare. */
+int aead_verify(struct aead_ctx *ctx, const uint8_t *tag)
+{
+	int i;
+	uint8_t t[16], d;
+
+	assert(tag);
+
+	aead_final(ctx, t);
+	for (i = 0, d = 0; i < 16; ++i)
+		d |= t[i] ^ tag[i];
+	return d == 0;
+}
+
+static int aead_iov_len(const struct iovec *v, int n)
+{
+	int i;
+	size_t len;
+
+	assert(n >= 0);
+	assert(n == 0 || v);
+
+	for (i = 0, len = 0; i < n; ++i)
+		len += v[i].iov_len;
+	assert(len <= INT_MAX);
+	return len;
+}
+
+/* Copy len bytes between buf and the iovec array, starting at offset off. */
+static void aead_iov_copy(const struct iovec *v, int n, int off,
+			  uint8_t *buf, int len, int to_iov)
+{
+	int i, k;
+	uint8_t *p;
+
+	for (i = 0; off >= (int)v[i].iov_len; ++i) {
+		off -= v[i].iov_len;
+		assert(i + 1 < n);
+	}
+
+	for (; len; ++i, off = 0) {
+		assert(i < n);
+		k = v[i].iov_len - off;
+		k = k < len ? k : len;
+		p = (uint8_t *)v[i].iov_base + off;
+		if (to_iov)
+			memcpy(p, buf, k);
+		else
+			memcpy(buf, p, k);
+		buf += k;
+		len -= k;
+	}
+}
+
+/* Zero the first len bytes of v. */
+static void aead_iov_zero(const struct iovec *v, int n, int len)
+{
+	int i, k;
+
+	for (i = 0; len; ++i) {
+		assert(i < n);
+		k = v[i].iov_len;
+		k = k < len ? k : len;
+		memset(v[i].iov_base, 0, k);
+		len -= k;
+	}
+}
+
+/*
+ * aead_update over the first len bytes of in, into out. The two arrays are
+ * walked along together, a contiguous run of both at a time.
+ */
+static void aead_updatev(struct aead_ctx *ctx, const struct iovec *out,
+			 int nout, const struct iovec *in, int nin, int len)
+{
+	int i, j, n;
+	size_t oi, oj;
+
+	for (i = j = 0, oi = oj = 0; len; len -= n, oi += n, oj += n) {
+		for (; oi == in[i].iov_len; ++i, oi = 0)
+			assert(i + 1 < nin);
+		for (; oj == out[j].iov_len; ++j, oj = 0)
+			assert(j + 1 < nout);
+
+		n = len;
+		if (in[i].iov_len - oi < (size_t)n)
+			n = in[i].iov_len - oi;
+		if (out[j].iov_len - oj < (size_t)n)
+			n = out[j].iov_len - oj;
+		aead_update(ctx, (uint8_t *)out[j].iov_base + oj,
+			    (const uint8_t *)in[i].iov_base + oi, n);
+	}
+}
+
+static void aead_update_aadv(struct aead_ctx *ctx, const struct iovec *aad,
+			     int naad)
+{
+	int i;
+
+	for (i = 0; i < naad; ++i)
+		aead_update_aad(ctx, aad[i].iov_base, aead_iov_len(&aad[i], 1));
+}
+
+int aead_encv(const uint8_t *key, const uint8_t *nonce,
+	      const struct iovec *aad, int naad, const struct iovec *in,
+	      int nin, const struct iovec *out, int nout)
+{
+	int mlen;
+	uint8_t tag[16];
+	struct aead_ctx ctx;
+
+	assert(key);
+	assert(nonce);
+
+	mlen = aead_iov_len(in, nin);
+	assert(aead_iov_len(out, nout) >= mlen + 16);
+
+	aead_init(&ctx, key, nonce, 1);
+	aead_update_aadv(&ctx, aad, naad);
+	aead_updatev(&ctx, out, nout, in, nin, mlen);
+	aead_final(&ctx, tag);
+	aead_iov_copy(out, nout, mlen, tag, 16, 1);
+	return mlen + 16;
+}
+
+/* Returns -1 on a bad tag, after wiping the output, as aead_dec. */
+int aead_decv(const uint8_t *key, const uint8_t *nonce,
+	      const struct iovec *aad, int naad, const struct iovec *in,
+	      int nin, const struct iovec *out, int nout)
+{
+	int mlen;
+	uint8_t tag[16];
+	struct aead_ctx ctx;
+
+	assert(key);
+	assert(nonce);
+
+	mlen = aead_iov_len(in, nin) - 16;
+	assert(mlen >= 0);
+	assert(aead_iov_len(out, nout) >= mlen);
+
+	/* Before the output may overwrite it. */
+	aead_iov_copy(in, nin, mlen, tag, 16, 0);
+
+	aead_init(&ctx, key, nonce, 0);
+	aead_update_aadv(&ctx, aad, naad);
+	aead_updatev(&ctx, out, nout, in, nin, mlen);
+	if (!aead_verify(&ctx, tag)) {
+		aead_iov_zero(out, nout, mlen);
+		return -1;
+	}
+	return mlen;
 }
 
 /* The last 16 bytes of the msg are the tag. */
 int aead_dec(const uint8_t* key, const uint8_t *nonce, const void *msg,
 	     int mlen,  const void *aad, int alen, uint8_t *out)
 {
-	struct chacha20_ctx ctx;
-	static uint8_t otk[32];
+	struct aead_ctx ctx;
 
 	assert(key);
 	assert(nonce);
@@ -52,28 +292,21 @@ int aead_dec(const uint8_t* key, const uint8_t *nonce, const void *msg,
 	assert(aad);
 	assert(out);
 
-	/* Generate the one time key for mac. */
-	memset(otk, 0, sizeof(otk));
-	chacha20_init(&ctx, key, nonce, 0);
-	chacha20_enc(&ctx, otk, otk, 32);
-
-	/* Generate mac. */
-	aead_mac(otk, otk, msg, mlen - 16, aad, alen);
-
-	/* Not-a-constant-time compare. */
-	assert(memcmp(otk, (const uint8_t *)msg + mlen - 16, 16) == 0);
-
-	/* Decrypt the data. */
-	chacha20_init(&ctx, key, nonce, 1);
-	chacha20_dec(&ctx, out, msg, mlen - 16);
+	/* A single pass; out is wiped, and -1 returned, on a bad tag. */
+	aead_init(&ctx, key, nonce, 0);
+	aead_update_aad(&ctx, aad, alen);
+	aead_update(&ctx, out, msg, mlen - 16);
+	if (!aead_verify(&ctx, (const uint8_t *)msg + mlen - 16)) {
+		memset(out, 0, mlen - 16);
+		return -1;
+	}
 	return mlen - 16;
 }
 
 int aead_enc(const uint8_t* key, const uint8_t *nonce, const void *msg,
 	     int mlen,  const void *aad, int alen, uint8_t *out)
 {
-	struct chacha20_ctx ctx;
-	static uint8_t otk[32];
+	struct aead_ctx ctx;
 
 	assert(key);
 	assert(nonce);
@@ -82,16 +315,9 @@ int aead_enc(const uint8_t* key, const uint8_t *nonce, const void *msg,
 	assert(aad);
 	assert(out);
 
-	/* Generate the one time key for mac. */
-	memset(otk, 0, sizeof(otk));
-	chacha20_init(&ctx, key, nonce, 0);
-	chacha20_enc(&ctx, otk, otk, 32);
-
-	/* Encrypt the data. */
-	chacha20_init(&ctx, key, nonce, 1);
-	chacha20_enc(&ctx, out, msg, mlen);
-
-	/* Generate mac. */
-	aead_mac(out + mlen, otk, out, mlen, aad, alen);
+	aead_init(&ctx, key, nonce, 1);
+	aead_update_aad(&ctx, aad, alen);
+	aead_update(&ctx, out, msg, mlen);
+	aead_final(&ctx, out + mlen);
 	return mlen + 16;
 }
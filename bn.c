@@ -12,10 +12,13 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <sys/bn.h>
+#include <bytes.h>
 #include <rndm.h>
 
-static struct bn_pool *g_pool = BN_POOL_INVALID;
+#include <sys/bn.h>
+
+/* The pool of the calling thread. */
+static _Thread_local struct bn_pool *g_pool = BN_POOL_INVALID;
 
 static const int bn_nlimbs[NUM_LIMB_SIZES] = {
 	1,2,4,8,
@@ -23,92 +26,270 @@ static const int bn_nlimbs[NUM_LIMB_SIZES] = {
 	256,512,1024,2048
 };
 
+/*
+ * With BN_DEBUG, the pool poisons the limbs it hands out and takes back, and
+ * checks its counters and the nsig invariant; all of which cost more than
+ * the O(1) list operations they guard.
+ */
+#ifdef BN_DEBUG
+#define bn_debug_assert(x)		assert(x)
+#else
+#define bn_debug_assert(x)
+#endif
+
+/*
+ * The size of the first slab of each class, and of each slab it grows by.
+ * The 64-bit sizes are those of the 32-bit limbs, shifted a class lower.
+ */
 static const int limbs_nfree[NUM_LIMB_SIZES] = {
+#if LIMB_BITS == 64
+	20,20,40,30,
+	20,10,10,10,
+#else
 	20,20,20,40,
 	30,20,10,10,
+#endif
 	10,10,10,10
 };
 
-static struct bn_pool *bn_pool_new()
+/* The smallest class that holds n limbs. */
+static int bn_limbs_class(int n)
 {
-	int i, j;
-	size_t sz, tsz;
-	struct bn_pool *p;
+	int i;
+
+	assert(n > 0);
+
+	i = bn_bsr((limb_t)n);
+	if ((1 << i) != n)
+		++i;
+	assert(i < NUM_LIMB_SIZES);
+	return i;
+}
+
+static size_t bn_slab_obj_size(int cls)
+{
+	if (cls < 0)
+		return sizeof(struct bn);
+	return sizeof(struct limbs) + (bn_nlimbs[cls] << LIMB_BYTES_LOG);
+}
+
+/* Add a slab of n free bns (cls < 0), or limbs of the class cls. */
+static void bn_pool_grow(struct bn_pool *p, int cls, int n)
+{
+	int i;
+	size_t sz;
+	char *o;
 	struct bn *tbn;
 	struct limbs *tl;
+	struct bn_slab *s;
+
+	assert(n > 0);
+
+	sz = bn_slab_obj_size(cls);
+	s = malloc(sizeof(*s) + n * sz);
+	assert(s);
+
+	s->pool = p;
+	s->cls = cls;
+	s->n = s->nfree = n;
+	list_add(&s->entry, &p->slabs);
+
+	o = (char *)(s + 1);
+	for (i = 0; i < n; ++i, o += sz) {
+		if (cls < 0) {
+			tbn = (struct bn *)o;
+			tbn->slab = s;
+			list_add(&tbn->entry, &p->free_nums);
+		} else {
+			tl = (struct limbs *)o;
+			tl->slab = s;
+			tl->n = bn_nlimbs[cls];
+			list_add(&tl->entry, &p->free_limbs[cls]);
+		}
+	}
+
+	if (cls < 0) {
+		p->nfree_nums += n;
+		p->ntotal_nums += n;
+	} else {
+		p->nfree_limbs[cls] += n;
+		p->ntotal_limbs[cls] += n;
+	}
+}
+
+/* Take a wholly free slab off the free lists, and free it. */
+static void bn_pool_shrink(struct bn_pool *p, struct bn_slab *s)
+{
+	int i;
+	size_t sz;
+	char *o;
+
+	assert(s->pool == p);
+	assert(s->nfree == s->n);
+
+	sz = bn_slab_obj_size(s->cls);
+	o = (char *)(s + 1);
+	for (i = 0; i < s->n; ++i, o += sz) {
+		if (s->cls < 0)
+			list_del(&((struct bn *)o)->entry);
+		else
+			list_del(&((struct limbs *)o)->entry);
+	}
+
+	if (s->cls < 0) {
+		p->nfree_nums -= s->n;
+		p->ntotal_nums -= s->n;
+	} else {
+		p->nfree_limbs[s->cls] -= s->n;
+		p->ntotal_limbs[s->cls] -= s->n;
+	}
+
+	list_del(&s->entry);
+	memwipe(s, sizeof(*s) + s->n * sz);
+	free(s);
+}
+
+static struct bn_pool *bn_pool_new()
+{
+	int i;
+	struct bn_pool *p;
 
 	p = malloc(sizeof(*p));
 	assert(p);
 
-	p->nfree_nums = NUM_FREE_BN;
+	atomic_init(&p->remote_nums, NULL);
+	atomic_init(&p->remote_limbs, NULL);
+	init_list_head(&p->slabs);
+
+	p->nfree_nums = p->ntotal_nums = p->npeak_nums = 0;
 	init_list_head(&p->free_nums);
-	p->nums = tbn = malloc(NUM_FREE_BN * sizeof(*tbn));
-	assert(tbn);
-	for (i = 0; i < NUM_FREE_BN; ++i)
-		list_add(&tbn[i].entry, &p->free_nums);
-
-	for (i = 0, sz = 0; i < NUM_LIMB_SIZES; ++i) {
-		tsz = sizeof(*tl) + (bn_nlimbs[i] << LIMB_BYTES_LOG);
-		tsz *= limbs_nfree[i];
-		sz += tsz;
-	}
-	p->limbs = tl = malloc(sz);
-	assert(tl);
+	bn_pool_grow(p, -1, NUM_FREE_BN);
 
 	for (i = 0; i < NUM_LIMB_SIZES; ++i) {
 		init_list_head(&p->free_limbs[i]);
+		p->nfree_limbs[i] = p->ntotal_limbs[i] = 0;
 		p->npeak_limbs[i] = 0;
-		p->nfree_limbs[i] = limbs_nfree[i];
-		sz = sizeof(*tl) + (bn_nlimbs[i] << LIMB_BYTES_LOG);
-		for (j = 0; j < limbs_nfree[i]; ++j) {
-			tl->n = bn_nlimbs[i];
-			list_add(&tl->entry, &p->free_limbs[i]);
-			tl = (struct limbs *)((char*)tl + sz);
-		}
+		bn_pool_grow(p, i, limbs_nfree[i]);
 	}
 	return p;
 }
 
+static void bn_pool_add_limbs(struct bn_pool *p, struct limbs *tl)
+{
+	int i;
+
+	i = tl->slab->cls;
+	bn_debug_assert(i >= 0 && i < NUM_LIMB_SIZES);
+	bn_debug_assert(tl->n == bn_nlimbs[i]);
+	bn_debug_assert(p->nfree_limbs[i] >= 0 &&
+			p->nfree_limbs[i] < p->ntotal_limbs[i]);
+
+	++tl->slab->nfree;
+	++p->nfree_limbs[i];
+	list_add(&tl->entry, &p->free_limbs[i]);
+}
+
+static void bn_pool_add_bn(struct bn_pool *p, struct bn *b)
+{
+	bn_debug_assert(p->nfree_nums >= 0 && p->nfree_nums < p->ntotal_nums);
+
+	++b->slab->nfree;
+	++p->nfree_nums;
+	list_add(&b->entry, &p->free_nums);
+}
+
+/*
+ * Any thread may push. Only the owner pops, and it takes the whole stack
+ * at once, so an entry cannot come back while a push is looking at it.
+ */
+static void bn_pool_push_remote(_Atomic(struct list_head *) *top,
+				struct list_head *e)
+{
+	struct list_head *old;
+
+	old = atomic_load_explicit(top, memory_order_relaxed);
+	do {
+		e->next = old;
+	} while (!atomic_compare_exchange_weak_explicit(top, &old, e,
+							memory_order_release,
+							memory_order_relaxed));
+}
+
+/* Take back what the other threads have freed. */
+static void bn_pool_drain_remote(struct bn_pool *p)
+{
+	struct list_head *e, *next;
+
+	e = atomic_exchange_explicit(&p->remote_limbs, NULL,
+				     memory_order_acquire);
+	for (; e; e = next) {
+		next = e->next;
+		bn_pool_add_limbs(p, to_limbs(e));
+	}
+
+	e = atomic_exchange_explicit(&p->remote_nums, NULL,
+				     memory_order_acquire);
+	for (; e; e = next) {
+		next = e->next;
+		bn_pool_add_bn(p, to_bn(e));
+	}
+}
+
 static void bn_pool_free(struct bn_pool *p)
 {
 	int i;
-	struct limbs *tl;
 	struct list_head *e;
+	struct bn_slab *s;
 
-	assert(p->nfree_nums == NUM_FREE_BN);
-	free(p->nums);
+	bn_pool_drain_remote(p);
 
-	for (i = 0; i < NUM_LIMB_SIZES; ++i) {
-		// printf("peak[%d] = %d\n", bn_nlimbs[i], p->npeak_limbs[i]);
-		assert(p->nfree_limbs[i] == limbs_nfree[i]);
-		while (!list_empty(&p->free_limbs[i])) {
-			e = list_del_head(&p->free_limbs[i]);
-			tl = to_limbs(e);
-			assert(tl->n == bn_nlimbs[i]);
-		}
+	/* Leaks. */
+	assert(p->nfree_nums == p->ntotal_nums);
+	for (i = 0; i < NUM_LIMB_SIZES; ++i)
+		assert(p->nfree_limbs[i] == p->ntotal_limbs[i]);
+
+	while (!list_empty(&p->slabs)) {
+		e = list_del_head(&p->slabs);
+		s = to_slab(e);
+		memwipe(s, sizeof(*s) + s->n * bn_slab_obj_size(s->cls));
+		free(s);
 	}
-	free(p->limbs);
 	free(p);
 }
 
 static struct bn *bn_pool_get_bn(struct bn_pool *p)
 {
+	int used;
 	struct list_head *e;
 	struct bn *b;
 
-	assert(p->nfree_nums > 0 && p->nfree_nums <= NUM_FREE_BN);
+	/* bn_init has not been called on this thread. */
+	assert(p != BN_POOL_INVALID);
+
+	if (p->nfree_nums == 0)
+		bn_pool_drain_remote(p);
+	if (p->nfree_nums == 0)
+		bn_pool_grow(p, -1, NUM_FREE_BN);
+	bn_debug_assert(p->nfree_nums > 0 && p->nfree_nums <= p->ntotal_nums);
 
 	--p->nfree_nums;
 	e = list_del_head(&p->free_nums);
 	b = to_bn(e);
+	--b->slab->nfree;
+
+	used = p->ntotal_nums - p->nfree_nums;
+	if (used > p->npeak_nums)
+		p->npeak_nums = used;
+
 	b->nsig = b->neg = -1;
+	b->fixed = b->secret = 0;
 	b->l = BN_LIMBS_INVALID;
 	return b;
 }
 
 static struct limbs *bn_pool_get_limbs(struct bn_pool *p, int n)
 {
-	int i, diff;
+	int i, used;
 	struct limbs *tl;
 	struct list_head *e;
 
@@ -117,77 +298,96 @@ static struct limbs *bn_pool_get_limbs(struct bn_pool *p, int n)
 	if (n == 0)
 		return BN_LIMBS_INVALID;
 
-	i = bn_bsr((limb_t)n);
-	if ((1 << i) != n)
-		++i;
-
-	/*
-	for (i = 0; i < NUM_LIMB_SIZES; ++i)
-		if (bn_nlimbs[i] >= n)
-			break;
-			*/
-
-	assert(i < NUM_LIMB_SIZES);
-	assert(p->nfree_limbs[i] > 0 && p->nfree_limbs[i] <= limbs_nfree[i]);
+	assert(p != BN_POOL_INVALID);
+	i = bn_limbs_class(n);
+	if (p->nfree_limbs[i] == 0)
+		bn_pool_drain_remote(p);
+	if (p->nfree_limbs[i] == 0)
+		bn_pool_grow(p, i, limbs_nfree[i]);
+	bn_debug_assert(p->nfree_limbs[i] > 0 &&
+			p->nfree_limbs[i] <= p->ntotal_limbs[i]);
 
 	--p->nfree_limbs[i];
 	e = list_del_head(&p->free_limbs[i]);
 	tl = to_limbs(e);
-	assert(tl->n == bn_nlimbs[i]);
+	bn_debug_assert(tl->n == bn_nlimbs[i]);
+	--tl->slab->nfree;
 
-	diff = limbs_nfree[i] - p->nfree_limbs[i];
-	if (diff > p->npeak_limbs[i])
-		p->npeak_limbs[i] = diff;
+	used = p->ntotal_limbs[i] - p->nfree_limbs[i];
+	if (used > p->npeak_limbs[i])
+		p->npeak_limbs[i] = used;
 
+#ifdef BN_DEBUG
 	memset(tl->l, -1, tl->n << LIMB_BYTES_LOG);
+#endif
 	return tl;
 }
 
-static void bn_pool_put_limbs(struct bn_pool *p, struct limbs *tl)
+/*
+ * To the free list of the owner; through its remote stack, if the owner is
+ * another thread. Freeing does not need a pool of one's own. The limbs are
+ * wiped only if they held a secret.
+ */
+static void bn_pool_put_limbs(struct limbs *tl, int secret)
 {
-	int i;
+	struct bn_pool *p;
 
 	assert(tl != BN_LIMBS_INVALID);
+	assert(tl->slab != BN_SLAB_INVALID);
 
-	i = bn_bsr((limb_t)tl->n);
-	if ((1 << i) != tl->n)
-		++i;
-
-	assert(i < NUM_LIMB_SIZES);
-	assert(p->nfree_limbs[i] >= 0 && p->nfree_limbs[i] < limbs_nfree[i]);
-
-	++p->nfree_limbs[i];
+	if (secret)
+		memwipe(tl->l, tl->n << LIMB_BYTES_LOG);
+#ifdef BN_DEBUG
 	memset(tl->l, -1, tl->n << LIMB_BYTES_LOG);
-	list_add(&tl->entry, &p->free_limbs[i]);
+#endif
+	p = tl->slab->pool;
+	if (p == g_pool)
+		bn_pool_add_limbs(p, tl);
+	else
+		bn_pool_push_remote(&p->remote_limbs, &tl->entry);
 }
 
 /* Also puts the limbs allocated to this bn. */
-static void bn_pool_put_bn(struct bn_pool *p, struct bn *b)
+static void bn_pool_put_bn(struct bn *b)
 {
+	struct bn_pool *p;
+
 	assert(b != BN_INVALID);
+	assert(!b->fixed);
+	assert(b->slab != BN_SLAB_INVALID);
 
-	assert(p->nfree_nums >= 0 && p->nfree_nums < NUM_FREE_BN);
 	if (b->l != BN_LIMBS_INVALID)
-		bn_pool_put_limbs(p, b->l);
+		bn_pool_put_limbs(b->l, b->secret);
 
 	b->nsig = b->neg = -1;
 	b->l = BN_LIMBS_INVALID;
 
-	++p->nfree_nums;
-	list_add(&b->entry, &p->free_nums);
+	p = b->slab->pool;
+	if (p == g_pool)
+		bn_pool_add_bn(p, b);
+	else
+		bn_pool_push_remote(&p->remote_nums, &b->entry);
 }
 
+/* Caller-owned limbs stay with their bn. */
 static void bn_zero(struct bn *b)
 {
+	b->nsig = b->neg = 0;
+	if (b->fixed)
+		return;
 	if (b->l != BN_LIMBS_INVALID)
-		bn_pool_put_limbs(g_pool, b->l);
+		bn_pool_put_limbs(b->l, b->secret);
 	b->l = BN_LIMBS_INVALID;
 	b->nsig = b->neg = 0;
 }
 
 static void bn_nsig_invariant(const struct bn *b)
 {
+#ifdef BN_DEBUG
 	assert(bn_is_zero(b) || b->l->l[b->nsig - 1]);
+#else
+	(void)b;
+#endif
 }
 
 /* Go to the next bn_nlimbs level. */
@@ -199,6 +399,13 @@ static void bn_expand(struct bn *b, int n)
 	assert(n <= bn_nlimbs[NUM_LIMB_SIZES - 1]);
 
 	tl = b->l;
+
+	/* Caller-owned storage does not grow. */
+	if (b->fixed) {
+		assert(tl->n >= n);
+		return;
+	}
+
 	assert(tl == BN_LIMBS_INVALID ||
 	       tl->n < bn_nlimbs[NUM_LIMB_SIZES - 1]);
 
@@ -211,7 +418,7 @@ static void bn_expand(struct bn *b, int n)
 	if (tl != BN_LIMBS_INVALID) {
 		assert(tlnew->n > tl->n);
 		memcpy(tlnew->l, tl->l, tl->n << LIMB_BYTES_LOG);
-		bn_pool_put_limbs(g_pool, tl);
+		bn_pool_put_limbs(tl, b->secret);
 	}
 	b->l = tlnew;
 }
@@ -321,10 +528,32 @@ static void bn_mul_limb(struct bn *a, limb_t b)
 	bn_nsig_invariant(a);
 }
 
+/*
+ * a = t; t is freed. The limbs of t are moved over, unless a is
+ * caller-owned, in which case they are copied.
+ */
+static void bn_take(struct bn *a, struct bn *t)
+{
+	if (a->fixed) {
+		bn_copy(a, t);
+		bn_free(t);
+		return;
+	}
+
+	/* a keeps its owner; only the value moves, and a secret with it. */
+	bn_zero(a);
+	a->l = t->l;
+	a->nsig = t->nsig;
+	a->neg = t->neg;
+	a->secret |= t->secret;
+	t->l = BN_LIMBS_INVALID;
+	bn_free(t);
+}
+
 /* https://courses.csail.mit.edu/6.006/spring11/exams/notes3-karatsuba */
 static void bn_mul_kar(struct bn *a, const struct bn *b)
 {
-	int mx, neg;
+	int mx, neg, secret;
 	struct bn ah, al, bh, bl, *t, *ra, *rd;
 
 	if (bn_is_zero(a))
@@ -337,6 +566,9 @@ static void bn_mul_kar(struct bn *a, const struct bn *b)
 
 	neg = a->neg != b->neg;
 
+	/* The partial products carry the secrets of both sides. */
+	secret = a->secret | b->secret;
+
 	if (b->nsig == 1) {
 		bn_mul_limb(a, b->l->l[0]);
 		if (!bn_is_zero(a))
@@ -346,14 +578,11 @@ static void bn_mul_kar(struct bn *a, const struct bn *b)
 
 	if (a->nsig == 1) {
 		t = bn_new_copy(b);
+		t->secret = secret;
 		bn_mul_limb(t, a->l->l[0]);
-		bn_zero(a);
-		*a = *t;
+		bn_take(a, t);
 		if (!bn_is_zero(a))
 			a->neg = neg;
-
-		t->l = BN_LIMBS_INVALID;
-		bn_free(t);
 		return;
 	}
 
@@ -376,6 +605,8 @@ static void bn_mul_kar(struct bn *a, const struct bn *b)
 	memset(&ah, 0, sizeof(ah));
 	memset(&bh, 0, sizeof(bh));
 	al.l = bl.l = ah.l = bh.l = BN_LIMBS_INVALID;
+	al.secret = ah.secret = secret;
+	bl.secret = bh.secret = secret;
 
 	al.nsig = mx < a->nsig ? mx : a->nsig;
 	bl.nsig = mx < b->nsig ? mx : b->nsig;
@@ -420,12 +651,9 @@ static void bn_mul_kar(struct bn *a, const struct bn *b)
 	bn_zero(&bh);
 	bn_free(rd);
 
-	bn_zero(a);
-	*a = *ra;
+	bn_take(a, ra);
 	if (!bn_is_zero(a))
 		a->neg = neg;
-	ra->l = BN_LIMBS_INVALID;
-	bn_free(ra);
 	bn_nsig_invariant(a);
 }
 
@@ -433,7 +661,6 @@ static void bn_mul_kar(struct bn *a, const struct bn *b)
 static void bn_sub_abs(struct bn *a, const struct bn *b)
 {
 	int cmp;
-	struct bn *t;
 	limb_t r;
 
 	cmp = bn_cmp_abs(a, b);
@@ -444,15 +671,21 @@ static void bn_sub_abs(struct bn *a, const struct bn *b)
 	}
 
 	if (cmp < 0) {
-		t = bn_new_copy(b);
-		assert(t->l != BN_LIMBS_INVALID);
-		r = limb_sub(t->l, 0, t->nsig, a->l, 0, a->nsig);
-		bn_zero(a);
-		*a = *t;
+		/*
+		 * b - a, computed in place as the two's complement of a - b,
+		 * which borrows out of the top limb.
+		 */
+		if (a->nsig < b->nsig) {
+			bn_expand(a, b->nsig);
+			memset(a->l->l + a->nsig, 0,
+			       (b->nsig - a->nsig) << LIMB_BYTES_LOG);
+			a->nsig = b->nsig;
+		}
+		r = limb_sub(a->l, 0, a->nsig, b->l, 0, b->nsig);
+		assert(r == (limb_t)-1);
+		limb_neg(a->l, a->nsig);
 		a->neg = 1;
-
-		t->l = BN_LIMBS_INVALID;
-		bn_free(t);
+		r = 0;
 	} else {
 		r = limb_sub(a->l, 0, a->nsig, b->l, 0, b->nsig);
 		a->neg = 0;
@@ -557,9 +790,20 @@ int bn_is_one(const struct bn *b)
 void bn_free(struct bn *a)
 {
 	assert(a != BN_INVALID);
-	bn_pool_put_bn(g_pool, a);
+	bn_pool_put_bn(a);
+}
+
+void bn_set_secret(struct bn *b)
+{
+	assert(b != BN_INVALID);
+	b->secret = 1;
 }
 
+/*
+ * Attach a pool to the calling thread; bn_fini detaches and frees it. The
+ * bns a thread allocates may be used and freed on any thread, but must all
+ * have been freed before their thread calls bn_fini.
+ */
 void bn_init()
 {
 	assert(g_pool == BN_POOL_INVALID);
@@ -574,6 +818,73 @@ void bn_fini()
 	g_pool = BN_POOL_INVALID;
 }
 
+void bn_stats(struct bn_stats *s)
+{
+	int i;
+	struct bn_pool *p = g_pool;
+
+	assert(p != BN_POOL_INVALID);
+	assert(s);
+
+	bn_pool_drain_remote(p);
+	for (i = 0; i < NUM_LIMB_SIZES; ++i) {
+		s->nlimbs[i] = bn_nlimbs[i];
+		s->ntotal[i] = p->ntotal_limbs[i];
+		s->nfree[i] = p->nfree_limbs[i];
+		s->npeak[i] = p->npeak_limbs[i];
+	}
+	s->nnums_total = p->ntotal_nums;
+	s->nnums_free = p->nfree_nums;
+	s->nnums_peak = p->npeak_nums;
+}
+
+/*
+ * A slab goes only if it is unused, and its class keeps enough blocks for
+ * the most it has had in use at once.
+ */
+void bn_trim()
+{
+	int ntotal, npeak;
+	struct list_head *e, *next;
+	struct bn_slab *s;
+	struct bn_pool *p = g_pool;
+
+	assert(p != BN_POOL_INVALID);
+
+	bn_pool_drain_remote(p);
+	for (e = p->slabs.next; e != &p->slabs; e = next) {
+		next = e->next;
+		s = to_slab(e);
+		if (s->nfree != s->n)
+			continue;
+
+		if (s->cls < 0) {
+			ntotal = p->ntotal_nums;
+			npeak = p->npeak_nums;
+		} else {
+			ntotal = p->ntotal_limbs[s->cls];
+			npeak = p->npeak_limbs[s->cls];
+		}
+		if (ntotal - s->n >= npeak)
+			bn_pool_shrink(p, s);
+	}
+}
+
+void bn_reserve(int nlimbs, int n)
+{
+	int i;
+	struct bn_pool *p = g_pool;
+
+	assert(p != BN_POOL_INVALID);
+	assert(n >= 0);
+
+	i = bn_limbs_class(nlimbs);
+	if (p->nfree_limbs[i] < n)
+		bn_pool_grow(p, i, n - p->nfree_limbs[i]);
+	if (p->nfree_nums < n)
+		bn_pool_grow(p, -1, n - p->nfree_nums);
+}
+
 struct bn *bn_new_zero()
 {
 	struct bn *b;
@@ -620,7 +931,7 @@ void bn_print(const char *msg, const struct bn *b)
 	if (b->neg)
 		printf("-");
 
-	fmt = "%x";
+	fmt = LIMB_FMT_STR_MSL;
 	for (i = b->nsig - 1; i >= 0; --i) {
 		printf(fmt, b->l->l[i]);
 		fmt = LIMB_FMT_STR;
@@ -635,6 +946,7 @@ struct bn *bn_new_copy(const struct bn *b)
 	assert(b != BN_INVALID);
 
 	a = bn_new_zero();
+	a->secret = b->secret;
 
 	if (bn_is_zero(b))
 		return a;
@@ -650,8 +962,8 @@ struct bn *bn_new_copy(const struct bn *b)
 /* TODO sign. */
 uint8_t *bn_to_bytes_be(const struct bn *b, int *len)
 {
-	int nbytes, i, j, z;
-	uint8_t *bytes, t[4];
+	int nbytes, i, j, k, z;
+	uint8_t *bytes, t[LIMB_BYTES];
 
 	assert(b != BN_INVALID);
 	assert(len != NULL);
@@ -674,24 +986,19 @@ uint8_t *bn_to_bytes_be(const struct bn *b, int *len)
 	z = 1;	/* Skip zeroes. */
 	j = 0;
 	i = b->nsig - 1;
-	t[0] = b->l->l[i] >> 24;
-	t[1] = b->l->l[i] >> 16;
-	t[2] = b->l->l[i] >> 8;
-	t[3] = b->l->l[i];
+	for (k = 0; k < LIMB_BYTES; ++k)
+		t[k] = b->l->l[i] >> ((LIMB_BYTES_MASK - k) << 3);
 
-	for (i = 0, j = 0; i < 4; ++i) {
+	for (i = 0, j = 0; i < LIMB_BYTES; ++i) {
 		if (z && t[i] == 0)
 			continue;
 		z = 0;
 		bytes[j++] = t[i];
 	}
 
-	for (i = b->nsig - 2; i >= 0; --i) {
-		bytes[j++] = b->l->l[i] >> 24;
-		bytes[j++] = b->l->l[i] >> 16;
-		bytes[j++] = b->l->l[i] >> 8;
-		bytes[j++] = b->l->l[i];
-	}
+	for (i = b->nsig - 2; i >= 0; --i)
+		for (k = LIMB_BYTES_MASK; k >= 0; --k)
+			bytes[j++] = b->l->l[i] >> (k << 3);
 
 	*len = j;
 	return bytes;
@@ -700,7 +1007,7 @@ uint8_t *bn_to_bytes_be(const struct bn *b, int *len)
 /* TODO sign. */
 uint8_t *bn_to_bytes_le(const struct bn *b, int *len)
 {
-	int nbytes, i, j;
+	int nbytes, i, j, k;
 	uint8_t *bytes;
 
 	assert(b != BN_INVALID);
@@ -719,12 +1026,9 @@ uint8_t *bn_to_bytes_le(const struct bn *b, int *len)
 	bytes = malloc(nbytes);
 	assert(bytes);
 
-	for (i = 0, j = 0; i < b->nsig; ++i) {
-		bytes[j++] = b->l->l[i];
-		bytes[j++] = b->l->l[i] >> 8;
-		bytes[j++] = b->l->l[i] >> 16;
-		bytes[j++] = b->l->l[i] >> 24;
-	}
+	for (i = 0, j = 0; i < b->nsig; ++i)
+		for (k = 0; k < LIMB_BYTES; ++k)
+			bytes[j++] = b->l->l[i] >> (k << 3);
 
 	for (i = j - 1; i >= 0; --i)
 		if (bytes[i])
@@ -759,7 +1063,7 @@ struct bn *bn_new_from_bytes_be(const uint8_t *bytes, int len)
 
 	k = j = val = 0;
 	for (i = len - 1; i >= 0; --i) {
-		val |= (uint32_t)bytes[i] << (j << 3);
+		val |= (limb_t)bytes[i] << (j << 3);
 		++j;
 
 		if (j != LIMB_BYTES && i)
@@ -776,24 +1080,14 @@ struct bn *bn_new_from_bytes_be(const uint8_t *bytes, int len)
 
 struct bn *bn_new_from_bytes_le(const uint8_t *bytes, int len)
 {
-	int i;
-	uint8_t *cb, t;
 	struct bn *b;
 
 	b = BN_INVALID;
 	if (bytes == NULL || len <= 0)
 		return b;
 
-	cb = malloc(len);
-	assert(cb);
-	memcpy(cb, bytes, len);
-	for (i = 0; i < len >> 1; ++i) {
-		t = cb[i];
-		cb[i] = cb[len - i - 1];
-		cb[len - i - 1] = t;
-	}
-	b = bn_new_from_bytes_be(cb, len);
-	free(cb);
+	b = bn_new_zero();
+	bn_set_bytes_le(b, bytes, len);
 	return b;
 }
 
@@ -1029,6 +1323,66 @@ void bn_mul(struct bn *a, const struct bn *b)
 	bn_nsig_invariant(a);
 }
 
+/* Caller-owned bns. See BN_DECLARE. */
+
+struct bn *bn_fixed_init(struct bn *b, struct limbs *l, int nl)
+{
+	assert(b != BN_INVALID && l != BN_LIMBS_INVALID);
+	assert(nl > 0);
+
+	l->slab = BN_SLAB_INVALID;
+	l->n = nl;
+	b->slab = BN_SLAB_INVALID;
+	b->l = l;
+	b->nsig = b->neg = 0;
+	b->fixed = 1;
+	b->secret = 0;
+	return b;
+}
+
+/* a = b. */
+void bn_copy(struct bn *a, const struct bn *b)
+{
+	assert(a != BN_INVALID && b != BN_INVALID);
+
+	if (a == b)
+		return;
+
+	if (bn_is_zero(b)) {
+		bn_zero(a);
+		return;
+	}
+
+	bn_expand(a, b->nsig);
+	memcpy(a->l->l, b->l->l, b->nsig << LIMB_BYTES_LOG);
+	a->nsig = b->nsig;
+	a->neg = b->neg;
+}
+
+/* a = the little-endian, unsigned number in bytes. */
+void bn_set_bytes_le(struct bn *a, const uint8_t *bytes, int len)
+{
+	int i, nlimbs;
+
+	assert(a != BN_INVALID && bytes != NULL);
+	assert(len >= 0);
+
+	nlimbs = (len + LIMB_BYTES_MASK) >> LIMB_BYTES_LOG;
+	if (nlimbs == 0) {
+		bn_zero(a);
+		return;
+	}
+
+	bn_expand(a, nlimbs);
+	memset(a->l->l, 0, nlimbs << LIMB_BYTES_LOG);
+	for (i = 0; i < len; ++i)
+		a->l->l[i >> LIMB_BYTES_LOG] |=
+			(limb_t)bytes[i] << ((i & LIMB_BYTES_MASK) << 3);
+	a->nsig = nlimbs;
+	a->neg = 0;
+	bn_snap(a);
+}
+
 /*
  * Due to Knuth Algorithm D (Division).
  * b = 2^LIMB_BITS.
@@ -1201,10 +1555,7 @@ void bn_mod(struct bn *a, const struct bn *b)
 	assert(bn_cmp_abs(a, ta) == 0);
 	bn_free(ta);
 
-	bn_zero(a);
-	*a = *rem;
-	rem->l = BN_LIMBS_INVALID;
-	bn_free(rem);
+	bn_take(a, rem);
 }
 
 /* Binary GCD algorithm. */
@@ -1256,11 +1607,10 @@ void bn_gcd(struct bn *a, const struct bn *b)
 
 	bn_shl(gcd, i);
 	bn_snap(gcd);
-	if (gcd == tb) {
-		*a = *tb;
-		tb->l = BN_LIMBS_INVALID;
-	}
-	bn_free(tb);
+	if (gcd == tb)
+		bn_take(a, tb);
+	else
+		bn_free(tb);
 }
 
 char bn_mod_inv(struct bn *a, const struct bn *m)
@@ -1339,10 +1689,7 @@ char bn_mod_inv(struct bn *a, const struct bn *m)
 	}
 	bn_snap(s1);
 
-	bn_zero(a);
-	*a = *s1;
-	s1->l = BN_LIMBS_INVALID;
-	bn_free(s1);
+	bn_take(a, s1);
 	return 1;
 }
 
@@ -1360,50 +1707,43 @@ char bn_mod_inv(struct bn *a, const struct bn *m)
 
 struct bn_ctx_mont *bn_ctx_mont_new(const struct bn *m)
 {
-	int msb;
-	struct bn *one, *t;
+	int i;
+	limb_t m0, x;
+	struct bn *t;
 	struct bn_ctx_mont *ctx;
 
 	/* Montgomery. Restrict to odd, >= 3 m. */
 	assert(!bn_is_even(m));
-
-	msb = bn_msb(m);
-	assert(msb >= 1);
+	assert(bn_msb(m) >= 1);
+	assert(m->neg == 0);
 
 	ctx = malloc(sizeof(*ctx));
 	assert(ctx);
-	ctx->msb = msb;
 	ctx->m = bn_new_copy(m);
 
-	one = bn_new_from_int(1);
-
-	ctx->r = bn_new_copy(one);
-	bn_shl(ctx->r, msb + 1);
-
-	ctx->mask = bn_new_copy(ctx->r);
-	bn_sub(ctx->mask, one);
-
-	ctx->one = bn_new_copy(ctx->r);
+	/*
+	 * Newton: x = m0^-1 mod 2^k implies x * (2 - m0 * x) = m0^-1 mod
+	 * 2^2k. For an odd m0, m0 * m0 = 1 mod 8.
+	 */
+	m0 = m->l->l[0];
+	x = m0;
+	for (i = 3; i < LIMB_BITS; i <<= 1)
+		x *= 2 - m0 * x;
+	assert((limb_t)(m0 * x) == 1);
+	ctx->minv = -x;
+
+	ctx->one = bn_new_from_int(1);
+	bn_shl(ctx->one, m->nsig << LIMB_BITS_LOG);
+	ctx->rr = bn_new_copy(ctx->one);
 	bn_mod(ctx->one, m);
 
-	ctx->rinv = bn_new_copy(ctx->r);
-	bn_mod_inv(ctx->rinv, m);
-
-	t = bn_new_copy(ctx->r);
-	bn_mul(t, ctx->rinv);	/* rr'. */
-	ctx->factor = bn_new_copy(t);
+	bn_shl(ctx->rr, m->nsig << LIMB_BITS_LOG);
+	bn_mod(ctx->rr, m);
 
-	/* Check rr' == 1 mod m. */
-	bn_mod(t, m);
-	assert(bn_is_one(t));
+	t = bn_new_from_int(2);
+	ctx->pm2 = bn_new_copy(m);
+	bn_sub(ctx->pm2, t);
 	bn_free(t);
-	t = BN_INVALID;
-
-	bn_sub(ctx->factor, one);
-	bn_div(ctx->factor, m, &t);
-	assert(bn_is_zero(t));
-	bn_free(t);
-	bn_free(one);
 	return ctx;
 }
 
@@ -1411,14 +1751,13 @@ void bn_ctx_mont_free(struct bn_ctx_mont *ctx)
 {
 	assert(ctx);
 	bn_free(ctx->m);
-	bn_free(ctx->r);
-	bn_free(ctx->rinv);
-	bn_free(ctx->factor);
+	bn_free(ctx->rr);
 	bn_free(ctx->one);
-	bn_free(ctx->mask);
+	bn_free(ctx->pm2);
 	free(ctx);
 }
 
+/* b * R mod m, as b * R^2 / R. */
 void bn_to_mont(const struct bn_ctx_mont *ctx, struct bn *b)
 {
 	assert(ctx);
@@ -1426,19 +1765,24 @@ void bn_to_mont(const struct bn_ctx_mont *ctx, struct bn *b)
 
 	if (bn_is_zero(b))
 		return;
-	bn_shl(b, ctx->msb + 1);
-	bn_mod(b, ctx->m);
+	if (bn_cmp_abs(b, ctx->m) >= 0)
+		bn_mod(b, ctx->m);
+	bn_mul_mont(ctx, b, ctx->rr);
 }
 
+/* b / R mod m, as b * 1 / R. */
 void bn_from_mont(const struct bn_ctx_mont *ctx, struct bn *b)
 {
+	BN_DECLARE(one, 1);
+
 	assert(ctx);
 	assert(b);
 
 	if (bn_is_zero(b))
 		return;
-	bn_mul(b, ctx->rinv);
-	bn_mod(b, ctx->m);
+	one->l->l[0] = 1;
+	one->nsig = 1;
+	bn_mul_mont(ctx, b, one);
 }
 
 /* a and b are in Montgomery form. */
@@ -1476,26 +1820,26 @@ void bn_add_mont(const struct bn_ctx_mont *ctx, struct bn *a,
 void bn_mul_mont(const struct bn_ctx_mont *ctx, struct bn *a,
 		 const struct bn *b)
 {
-	struct bn *t;
+	int n;
+	limb_t t[ctx->m->nsig + 2];
 
 	assert(a->neg == 0);
 	assert(b->neg == 0);
 	assert(bn_cmp_abs(a, ctx->m) < 0);
 	assert(bn_cmp_abs(b, ctx->m) < 0);
 
-	bn_mul(a, b);
-	t = bn_new_copy(a);
-	bn_and(a, ctx->mask);
-	bn_mul(a, ctx->factor);
-	bn_and(a, ctx->mask);
-	bn_mul(a, ctx->m);
-	bn_add(a, t);
-	bn_shr(a, ctx->msb + 1);
-
-	if (bn_cmp_abs(a, ctx->m) >= 0)
-		bn_sub(a, ctx->m);
+	if (bn_is_zero(a) || bn_is_zero(b)) {
+		bn_zero(a);
+		return;
+	}
 
-	bn_free(t);
+	n = ctx->m->nsig;
+	limb_mul_mont(t, a->l, a->nsig, b->l, b->nsig, ctx->m->l, n,
+		      ctx->minv);
+	bn_expand(a, n);
+	memcpy(a->l->l, t, n << LIMB_BYTES_LOG);
+	a->nsig = n;
+	bn_snap(a);
 	assert(bn_cmp_abs(a, ctx->m) < 0);
 }
 
@@ -1521,10 +1865,30 @@ void bn_mod_pow_mont(const struct bn_ctx_mont *ctx,
 		if (i < nbits - 1)
 			bn_mul_mont(ctx, a, a);
 	}
-	bn_zero(a);
-	*a = *pow;
-	pow->l = BN_LIMBS_INVALID;
-	bn_free(pow);
+	bn_take(a, pow);
+}
+
+/*
+ * a^-1, by Fermat: a^(m - 2), for a prime m. a is in Montgomery form, and
+ * non-zero. Left-to-right; the sequence of squarings and multiplications
+ * depends on m alone.
+ */
+void bn_mod_inv_mont(const struct bn_ctx_mont *ctx, struct bn *a)
+{
+	int i;
+	struct bn *b;
+
+	assert(ctx);
+	assert(a != BN_INVALID);
+	assert(!bn_is_zero(a));
+
+	b = bn_new_copy(a);
+	for (i = bn_msb(ctx->pm2) - 1; i >= 0; --i) {
+		bn_mul_mont(ctx, a, a);
+		if (bn_test_bit(ctx->pm2, i))
+			bn_mul_mont(ctx, a, b);
+	}
+	bn_free(b);
 }
 
 /* a^e % m. */
@@ -1549,11 +1913,10 @@ void bn_mod_pow(struct bn *a, const struct bn *e, const struct bn *m)
 /*
  * http://www.math.vt.edu/people/brown/class_homepages/shanks_tonelli.pdf
  *
- * Tonelli-Shanks. m must be an odd prime, and gcd(a,m) == 1. The second
- * condition applies when a is an element of the prime field defined over m,
- * the only usecase for this function at the moment.
+ * Tonelli-Shanks. m must be an odd prime, and a an element of the prime
+ * field defined over m. Returns 0, with a untouched, if a is not a square.
  */
-void bn_mod_sqrt(struct bn *a, const struct bn *m)	/* m == modulus. */
+char bn_mod_sqrt(struct bn *a, const struct bn *m)	/* m == modulus. */
 {
 	int bits, i, r, found;
 	struct bn *exp, *t, *s, *q, *one, *ma;
@@ -1563,13 +1926,17 @@ void bn_mod_sqrt(struct bn *a, const struct bn *m)	/* m == modulus. */
 	assert(a->neg == 0);
 	assert(m->neg == 0);
 
+	/* gcd(a,m) == m. */
+	if (bn_is_zero(a))
+		return 1;
+
 	one = bn_new_from_int(1);
 
 	ctx = bn_ctx_mont_new(m);
 
-	/* Convert a into Montgomery form. */
-	bn_to_mont(ctx, a);
+	/* Convert a into Montgomery form. Work on a copy, as in bn_mod_inv. */
 	ma = bn_new_copy(a);
+	bn_to_mont(ctx, ma);
 
 	/* First: Euler's criterion to check if the sqrt exists. */
 	exp = bn_new_copy(m);
@@ -1577,10 +1944,19 @@ void bn_mod_sqrt(struct bn *a, const struct bn *m)	/* m == modulus. */
 	s = bn_new_copy(exp);	/* s = m - 1 */
 	bn_shr(exp, 1);		/* exp = (m - 1) / 2 */
 
-	bn_mod_pow_mont(ctx, a, exp);
+	t = bn_new_copy(ma);
+	bn_mod_pow_mont(ctx, t, exp);
 	/* The result is not 1. Hence, sqrt does not exist. */
-	if (bn_cmp_abs(a, ctx->one))
-		assert(0);
+	found = !bn_cmp_abs(t, ctx->one);
+	bn_free(t);
+	if (!found) {
+		bn_free(exp);
+		bn_free(s);
+		bn_free(ma);
+		bn_free(one);
+		bn_ctx_mont_free(ctx);
+		return 0;
+	}
 
 	/* Find s*2^e = m - 1 */
 	bits = 0;
@@ -1679,10 +2055,8 @@ void bn_mod_sqrt(struct bn *a, const struct bn *m)	/* m == modulus. */
 	bn_from_mont(ctx, x);
 	bn_ctx_mont_free(ctx);
 
-	bn_zero(a);
-	*a = *x;
-	x->l = BN_LIMBS_INVALID;
-	bn_free(x);
+	bn_take(a, x);
+	return 1;
 }
 
 
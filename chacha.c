@@ -7,6 +7,11 @@
 #include <assert.h>
 #include <string.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CHACHA20_SIMD
+#endif
+
 #include <bytes.h>
 
 #include <sys/chacha.h>
@@ -99,33 +104,271 @@ static void chacha20_block(struct chacha20 *c)
 	assert(c->state[12]);
 }
 
+#ifdef CHACHA20_SIMD
+/*
+ * The vector paths run several blocks at once, one block per 32-bit lane:
+ * x[i] holds word i of each of the blocks, and the counters are
+ * state[12] + lane. At the end, the words are transposed back into the
+ * blocks, and the keystream is XORed into out a vector at a time.
+ *
+ * SSE2 is part of x86-64; AVX2 is checked for at run time.
+ */
+#define ROTL_SSE2(v, c)							\
+	_mm_or_si128(_mm_slli_epi32(v, c), _mm_srli_epi32(v, 32 - (c)))
+
+#define QR_SSE2(x, a, b, c, d)						\
+	do {								\
+		x[a] = _mm_add_epi32(x[a], x[b]);			\
+		x[d] = ROTL_SSE2(_mm_xor_si128(x[d], x[a]), 16);	\
+		x[c] = _mm_add_epi32(x[c], x[d]);			\
+		x[b] = ROTL_SSE2(_mm_xor_si128(x[b], x[c]), 12);	\
+		x[a] = _mm_add_epi32(x[a], x[b]);			\
+		x[d] = ROTL_SSE2(_mm_xor_si128(x[d], x[a]), 8);		\
+		x[c] = _mm_add_epi32(x[c], x[d]);			\
+		x[b] = ROTL_SSE2(_mm_xor_si128(x[b], x[c]), 7);		\
+	} while(0)
+
+/* 4 blocks per round trip. n is a multiple of 4. */
+static void chacha20_blocks_sse2(struct chacha20 *c, uint8_t *out,
+				 const uint8_t *in, int n)
+{
+	int i, j, k;
+	__m128i s[16], x[16], t[4], y[4], m;
+
+	for (; n; n -= 4, in += 256, out += 256) {
+		for (i = 0; i < 16; ++i)
+			s[i] = _mm_set1_epi32(c->state[i]);
+		s[12] = _mm_add_epi32(s[12], _mm_set_epi32(3, 2, 1, 0));
+
+		for (i = 0; i < 16; ++i)
+			x[i] = s[i];
+		for (i = 0; i < 10; ++i) {
+			QR_SSE2(x, 0, 4, 8, 12);
+			QR_SSE2(x, 1, 5, 9, 13);
+			QR_SSE2(x, 2, 6, 10, 14);
+			QR_SSE2(x, 3, 7, 11, 15);
+
+			QR_SSE2(x, 0, 5, 10, 15);
+			QR_SSE2(x, 1, 6, 11, 12);
+			QR_SSE2(x, 2, 7, 8, 13);
+			QR_SSE2(x, 3, 4, 9, 14);
+		}
+		for (i = 0; i < 16; ++i)
+			x[i] = _mm_add_epi32(x[i], s[i]);
+
+		/* y[k] = words 4j .. 4j + 3 of block k. */
+		for (j = 0; j < 4; ++j) {
+			t[0] = _mm_unpacklo_epi32(x[4 * j], x[4 * j + 1]);
+			t[1] = _mm_unpackhi_epi32(x[4 * j], x[4 * j + 1]);
+			t[2] = _mm_unpacklo_epi32(x[4 * j + 2], x[4 * j + 3]);
+			t[3] = _mm_unpackhi_epi32(x[4 * j + 2], x[4 * j + 3]);
+			y[0] = _mm_unpacklo_epi64(t[0], t[2]);
+			y[1] = _mm_unpackhi_epi64(t[0], t[2]);
+			y[2] = _mm_unpacklo_epi64(t[1], t[3]);
+			y[3] = _mm_unpackhi_epi64(t[1], t[3]);
+
+			for (k = 0; k < 4; ++k) {
+				i = 64 * k + 16 * j;
+				m = _mm_loadu_si128((const __m128i *)(in + i));
+				_mm_storeu_si128((__m128i *)(out + i),
+						 _mm_xor_si128(m, y[k]));
+			}
+		}
+		c->state[12] += 4;
+	}
+}
+
+#define ROTL_AVX2(v, c)							\
+	_mm256_or_si256(_mm256_slli_epi32(v, c),			\
+			_mm256_srli_epi32(v, 32 - (c)))
+
+/* The rotations by 16 and 8 move whole bytes; r16 and r8 do those. */
+#define QR_AVX2(x, a, b, c, d)						\
+	do {								\
+		x[a] = _mm256_add_epi32(x[a], x[b]);			\
+		x[d] = _mm256_shuffle_epi8(				\
+			_mm256_xor_si256(x[d], x[a]), r16);		\
+		x[c] = _mm256_add_epi32(x[c], x[d]);			\
+		x[b] = ROTL_AVX2(_mm256_xor_si256(x[b], x[c]), 12);	\
+		x[a] = _mm256_add_epi32(x[a], x[b]);			\
+		x[d] = _mm256_shuffle_epi8(				\
+			_mm256_xor_si256(x[d], x[a]), r8);		\
+		x[c] = _mm256_add_epi32(x[c], x[d]);			\
+		x[b] = ROTL_AVX2(_mm256_xor_si256(x[b], x[c]), 7);	\
+	} while(0)
+
+/* 8 blocks per round trip. n is a multiple of 8. */
+__attribute__((target("avx2")))
+static void chacha20_blocks_avx2(struct chacha20 *c, uint8_t *out,
+				 const uint8_t *in, int n)
+{
+	int i, j, k;
+	__m256i s[16], x[16], t[4], v[4], r16, r8, m;
+
+	r16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10,
+			      5, 4, 7, 6, 1, 0, 3, 2,
+			      13, 12, 15, 14, 9, 8, 11, 10,
+			      5, 4, 7, 6, 1, 0, 3, 2);
+	r8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11,
+			     6, 5, 4, 7, 2, 1, 0, 3,
+			     14, 13, 12, 15, 10, 9, 8, 11,
+			     6, 5, 4, 7, 2, 1, 0, 3);
+
+	for (; n; n -= 8, in += 512, out += 512) {
+		for (i = 0; i < 16; ++i)
+			s[i] = _mm256_set1_epi32(c->state[i]);
+		s[12] = _mm256_add_epi32(s[12],
+					 _mm256_set_epi32(7, 6, 5, 4,
+							  3, 2, 1, 0));
+
+		for (i = 0; i < 16; ++i)
+			x[i] = s[i];
+		for (i = 0; i < 10; ++i) {
+			QR_AVX2(x, 0, 4, 8, 12);
+			QR_AVX2(x, 1, 5, 9, 13);
+			QR_AVX2(x, 2, 6, 10, 14);
+			QR_AVX2(x, 3, 7, 11, 15);
+
+			QR_AVX2(x, 0, 5, 10, 15);
+			QR_AVX2(x, 1, 6, 11, 12);
+			QR_AVX2(x, 2, 7, 8, 13);
+			QR_AVX2(x, 3, 4, 9, 14);
+		}
+		for (i = 0; i < 16; ++i)
+			x[i] = _mm256_add_epi32(x[i], s[i]);
+
+		/*
+		 * In place, x[4j + k] = words 4j .. 4j + 3 of block k in the
+		 * low 128 bits, and of block 4 + k in the high 128 bits.
+		 */
+		for (j = 0; j < 4; ++j) {
+			t[0] = _mm256_unpacklo_epi32(x[4 * j], x[4 * j + 1]);
+			t[1] = _mm256_unpackhi_epi32(x[4 * j], x[4 * j + 1]);
+			t[2] = _mm256_unpacklo_epi32(x[4 * j + 2],
+						     x[4 * j + 3]);
+			t[3] = _mm256_unpackhi_epi32(x[4 * j + 2],
+						     x[4 * j + 3]);
+			x[4 * j] = _mm256_unpacklo_epi64(t[0], t[2]);
+			x[4 * j + 1] = _mm256_unpackhi_epi64(t[0], t[2]);
+			x[4 * j + 2] = _mm256_unpacklo_epi64(t[1], t[3]);
+			x[4 * j + 3] = _mm256_unpackhi_epi64(t[1], t[3]);
+		}
+
+		/* Block k, then block 4 + k, 32 bytes at a time. */
+		for (k = 0; k < 4; ++k) {
+			v[0] = _mm256_permute2x128_si256(x[k], x[4 + k], 0x20);
+			v[1] = _mm256_permute2x128_si256(x[8 + k], x[12 + k],
+							 0x20);
+			v[2] = _mm256_permute2x128_si256(x[k], x[4 + k], 0x31);
+			v[3] = _mm256_permute2x128_si256(x[8 + k], x[12 + k],
+							 0x31);
+			for (j = 0; j < 4; ++j) {
+				i = 64 * (k + 4 * (j >> 1)) + 32 * (j & 1);
+				m = _mm256_loadu_si256((const __m256i *)
+						       (in + i));
+				_mm256_storeu_si256((__m256i *)(out + i),
+						    _mm256_xor_si256(m, v[j]));
+			}
+		}
+		c->state[12] += 8;
+	}
+}
+#endif
+
+/*
+ * XOR the keystream of as many of the n whole blocks as the vector paths
+ * take at once into out. Returns the number of blocks done; the rest are
+ * left to chacha20_block.
+ */
+static int chacha20_blocks(struct chacha20 *c, uint8_t *out,
+			   const uint8_t *in, int n)
+{
+#ifdef CHACHA20_SIMD
+	int avx2;
+
+	/* A multiple of 8 blocks says nothing about the CPU. */
+	avx2 = n >= 8 && __builtin_cpu_supports("avx2");
+	if (avx2)
+		n &= ~7;
+	else
+		n &= ~3;
+	if (n == 0)
+		return 0;
+
+	/* As in chacha20_block, the counter must not wrap. */
+	assert((uint64_t)c->state[12] + n <= UINT32_MAX);
+	if (avx2)
+		chacha20_blocks_avx2(c, out, in, n);
+	else
+		chacha20_blocks_sse2(c, out, in, n);
+	return n;
+#else
+	(void)c;
+	(void)out;
+	(void)in;
+	(void)n;
+	return 0;
+#endif
+}
+
+/* out = in ^ s, for n bytes; 8 at a time, through memcpy for alignment. */
+static void chacha20_xor(uint8_t *out, const uint8_t *in, const uint8_t *s,
+			 int n)
+{
+	uint64_t a, b;
+
+	for (; n >= 8; n -= 8, out += 8, in += 8, s += 8) {
+		memcpy(&a, in, 8);
+		memcpy(&b, s, 8);
+		a ^= b;
+		memcpy(out, &a, 8);
+	}
+	for (; n; --n)
+		*out++ = *in++ ^ *s++;
+}
+
+/*
+ * The stream buffer and ix only serve the head and the tail of a request,
+ * i.e. the parts that do not fill a block of their own.
+ */
 void chacha20_enc(struct chacha20_ctx *ctx, void *out, const void *in, int len)
 {
-	int i, left, n;
+	int n;
 	const uint8_t *p;
 	uint8_t *q, *s;
 	struct chacha20 *c;
 
 	assert(ctx);
+	assert(len >= 0);
 	c = (struct chacha20 *)ctx;
 	p = in;
 	q = out;
 	s = (uint8_t *)c->stream;
 
-	for (;len;) {
-		if (c->ix == 64) {
-			chacha20_block(c);
-			c->ix = 0;
-		}
+	/* The head: the rest of the current block. */
+	n = 64 - c->ix;
+	n = n < len ? n : len;
+	chacha20_xor(q, p, s + c->ix, n);
+	c->ix += n;
+	q += n;
+	p += n;
+	len -= n;
+
+	/* Whole blocks; the vector paths first. */
+	n = chacha20_blocks(c, q, p, len >> 6);
+	q += n << 6;
+	p += n << 6;
+	len -= n << 6;
+	for (; len >= 64; len -= 64, q += 64, p += 64) {
+		chacha20_block(c);
+		chacha20_xor(q, p, s, 64);
+	}
 
-		left = 64 - c->ix;
-		n = left < len ? left : len;
-		for (i = 0; i < n; ++i)
-			q[i] = p[i] ^ s[c->ix + i];
-		c->ix += n;
-		q += n;
-		p += n;
-		len -= n;
+	/* The tail. */
+	if (len) {
+		chacha20_block(c);
+		chacha20_xor(q, p, s, len);
+		c->ix = len;
 	}
 }
 
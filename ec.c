@@ -8,9 +8,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <bytes.h>
 #include <rndm.h>
 #include <sha2.h>
 
+#include <sys/bn.h>
 #include <sys/ec.h>
 
 /* Numbers as big-endian strings. */
@@ -31,6 +33,100 @@ const char *ed25519_gx_be =
 const char *ed25519_gy_be =
 "6666666666666666666666666666666666666666666666666666666666666658";
 
+/* GF(2^255 - 19) backend. */
+
+static int ec_prime_is_25519(const struct bn *prime)
+{
+	int ret;
+	struct bn *t;
+
+	t = bn_new_from_string_be(c25519_prime_be, 16);
+	ret = bn_cmp(prime, t) == 0;
+	bn_free(t);
+	return ret;
+}
+
+/* b is in the Montgomery form of the curve's mctx; h is a regular number. */
+static void ec_fe_from_mont(const struct ec_fe *fe, struct fe *h,
+			    const struct bn *b)
+{
+	fe_from_bn(h, b);
+	fe_mul(h, h, &fe->rinv);
+}
+
+static struct bn *ec_fe_to_mont(const struct ec_fe *fe, const struct fe *h)
+{
+	struct fe t;
+
+	fe_mul(&t, h, &fe->r);
+	return fe_to_bn(&t);
+}
+
+static struct ec_fe *ec_fe_new(const struct bn_ctx_mont *mctx,
+			       const struct bn *a)
+{
+	struct bn *t;
+	struct ec_fe *fe;
+
+	fe = malloc(sizeof(*fe));
+	assert(fe);
+
+	/* The Montgomery form of 1 is R mod p. */
+	t = bn_new_from_int(1);
+	bn_to_mont(mctx, t);
+	fe_from_bn(&fe->r, t);
+	bn_free(t);
+	fe_invert(&fe->rinv, &fe->r);
+
+	ec_fe_from_mont(fe, &fe->a, a);
+	fe_zero(&fe->cnst);
+	fe_zero(&fe->d);
+	fe_zero(&fe->d2);
+	atomic_init(&fe->base, NULL);
+	return fe;
+}
+
+/*
+ * z[i] = 1 / z[i], by Montgomery's trick: a single inversion, and 3
+ * multiplications per element. None of the z[i] may be 0.
+ */
+static void ec_fe_batch_invert(struct fe *z, int n)
+{
+	int i;
+	struct fe *acc, inv, t;
+
+	assert(n > 0);
+
+	acc = malloc(n * sizeof(*acc));
+	assert(acc);
+
+	/* acc[i] = z[0] * ... * z[i]. */
+	acc[0] = z[0];
+	for (i = 1; i < n; ++i)
+		fe_mul(&acc[i], &acc[i - 1], &z[i]);
+
+	fe_invert(&inv, &acc[n - 1]);
+	for (i = n - 1; i > 0; --i) {
+		fe_mul(&t, &inv, &acc[i - 1]);		/* 1 / z[i] */
+		fe_mul(&inv, &inv, &z[i]);		/* 1 / acc[i - 1] */
+		z[i] = t;
+	}
+	z[0] = inv;
+	free(acc);
+}
+
+static int ec_fe_is_minus_one(const struct fe *f)
+{
+	uint8_t s[32], m[32];
+	struct fe t;
+
+	fe_one(&t);
+	fe_neg(&t, &t);
+	fe_to_bytes(m, &t);
+	fe_to_bytes(s, f);
+	return memcmp(s, m, 32) == 0;
+}
+
 struct bn *ecm_point_x(const struct ec_mont *ec, const struct ec_point *a)
 {
 	struct bn *t;
@@ -123,6 +219,8 @@ void ecm_free(struct ec_mont *ec)
 		bn_free(ec->gen.z);
 	if (ec->mctx)
 		bn_ctx_mont_free(ec->mctx);
+	if (ec->fe)
+		free(ec->fe);
 	free(ec);
 }
 
@@ -139,6 +237,7 @@ struct ec_mont *ec_new_montgomery(const struct ec_mont_params *p)
 
 	ec->prime = ec->a = ec->b = ec->order = BN_INVALID;
 	ec->gen.x = ec->gen.y = ec->gen.z = BN_INVALID;
+	ec->fe = NULL;
 
 	/*
 	 * Order and Prime are kept as regular numbers.
@@ -184,6 +283,11 @@ struct ec_mont *ec_new_montgomery(const struct ec_mont_params *p)
 	bn_to_mont(ec->mctx, ec->gen.x);
 	bn_to_mont(ec->mctx, ec->gen.z);
 	bn_to_mont(ec->mctx, ec->cnst);
+
+	if (ec_prime_is_25519(ec->prime)) {
+		ec->fe = ec_fe_new(ec->mctx, ec->a);
+		ec_fe_from_mont(ec->fe, &ec->fe->cnst, ec->cnst);
+	}
 	return ec;
 err1:
 	for (i = 0; i < 9; ++i)
@@ -194,16 +298,138 @@ err0:
 	return EC_INVALID;
 }
 
+static void ecm_fe_point_get(const struct ec_mont *ec, struct ec_fe_point *p,
+			     const struct ec_point *a)
+{
+	ec_fe_from_mont(ec->fe, &p->x, a->x);
+	ec_fe_from_mont(ec->fe, &p->z, a->z);
+}
+
+static void ecm_fe_point_put(const struct ec_mont *ec, struct ec_point *a,
+			     const struct ec_fe_point *p)
+{
+	bn_free(a->x);
+	bn_free(a->z);
+	a->x = ec_fe_to_mont(ec->fe, &p->x);
+	a->z = ec_fe_to_mont(ec->fe, &p->z);
+}
+
+/* The fe counterparts of ecm_dbl, ecm_diffadd, ecm_point_normalize. */
+static void ecm_fe_dbl(const struct ec_mont *ec, struct ec_fe_point *a)
+{
+	struct fe t[4];
+
+	fe_add(&t[0], &a->x, &a->z);
+	fe_sq(&t[0], &t[0]);			/* (x + z)^2 */
+	fe_sub(&t[1], &a->x, &a->z);
+	fe_sq(&t[1], &t[1]);			/* (x - z)^2 */
+	fe_sub(&t[2], &t[0], &t[1]);		/* diff of sqr */
+	fe_mul(&a->x, &t[0], &t[1]);		/* mul of sqr */
+	fe_mul(&t[3], &t[2], &ec->fe->cnst);
+	fe_add(&t[3], &t[3], &t[1]);
+	fe_mul(&a->z, &t[3], &t[2]);
+}
+
+static void ecm_fe_diffadd(const struct ec_mont *ec, struct ec_fe_point *a,
+			   const struct ec_fe_point *b,
+			   const struct ec_fe_point *c)
+{
+	struct fe t[6];
+
+	(void)ec;
+
+	fe_add(&t[0], &b->x, &b->z);
+	fe_sub(&t[1], &b->x, &b->z);
+	fe_add(&t[2], &c->x, &c->z);
+	fe_sub(&t[3], &c->x, &c->z);
+
+	fe_mul(&t[3], &t[3], &t[0]);
+	fe_mul(&t[2], &t[2], &t[1]);
+
+	fe_add(&t[4], &t[3], &t[2]);
+	fe_sq(&t[4], &t[4]);
+	fe_sub(&t[5], &t[3], &t[2]);
+	fe_sq(&t[5], &t[5]);
+
+	fe_mul(&t[4], &t[4], &a->z);
+	fe_mul(&a->z, &t[5], &a->x);
+	a->x = t[4];
+}
+
+static void ecm_fe_point_normalize(struct ec_fe_point *a)
+{
+	struct fe t;
+
+	fe_invert(&t, &a->z);
+	fe_mul(&a->x, &a->x, &t);
+	fe_one(&a->z);
+}
+
+/* Bit i of the n little-endian bytes s; 0 past the end. */
+static int ec_bytes_bit(const uint8_t *s, int n, int i)
+{
+	if ((i >> 3) >= n)
+		return 0;
+	return (s[i >> 3] >> (i & 7)) & 1;
+}
+
+static void ecm_fe_cswap(struct ec_fe_point *a, struct ec_fe_point *b,
+			 int bit)
+{
+	fe_cswap(&a->x, &b->x, bit);
+	fe_cswap(&a->z, &b->z, bit);
+}
+
+/*
+ * The ladder of RFC 7748, over all the nbits bits of s: pt[0] starts at the
+ * identity (1 : 0), and the pair is swapped without branches whenever the
+ * bit changes. Each step costs the same, whatever the bits.
+ */
+static void ecm_fe_scale(const struct ec_mont *ec, struct ec_fe_point *a,
+			 const uint8_t *s, int n, int nbits)
+{
+	int i, bit, swap;
+	struct ec_fe_point pt[2], q;
+
+	fe_one(&pt[0].x);
+	fe_zero(&pt[0].z);
+	pt[1] = *a;
+	swap = 0;
+
+	for (i = nbits - 1; i >= 0; --i) {
+		bit = ec_bytes_bit(s, n, i);
+		ecm_fe_cswap(&pt[0], &pt[1], swap ^ bit);
+		swap = bit;
+
+		/* Difference between pt[0] and pt[1] is always == a. */
+		q = *a;
+		ecm_fe_diffadd(ec, &q, &pt[0], &pt[1]);
+		pt[1] = q;
+		ecm_fe_dbl(ec, &pt[0]);
+	}
+	ecm_fe_cswap(&pt[0], &pt[1], swap);
+	ecm_fe_point_normalize(&pt[0]);
+	*a = pt[0];
+}
+
 /* All co-ordinates in projective, Montgomery form. */
 
 /* http://hyperelliptic.org/EFD/g1p/auto-montgom-xz.html */
 void ecm_dbl(const struct ec_mont *ec, struct ec_point *a)
 {
 	struct bn *t[4];
+	struct ec_fe_point p;
 
 	assert(ec != EC_INVALID);
 	assert(a != EC_POINT_INVALID);
 
+	if (ec->fe) {
+		ecm_fe_point_get(ec, &p, a);
+		ecm_fe_dbl(ec, &p);
+		ecm_fe_point_put(ec, a, &p);
+		return;
+	}
+
 	t[0] = bn_new_copy(a->x);
 	bn_add_mont(ec->mctx, t[0], a->z);
 	bn_mul_mont(ec->mctx, t[0], t[0]);	/* (x + z)^2 */
@@ -243,12 +469,22 @@ void ecm_diffadd(const struct ec_mont *ec, struct ec_point *a,
 		 const struct ec_point *b, const struct ec_point *c)
 {
 	struct bn *t[8];
+	struct ec_fe_point p[3];
 
 	assert(ec != EC_INVALID);
 	assert(a != EC_POINT_INVALID);
 	assert(b != EC_POINT_INVALID);
 	assert(c != EC_POINT_INVALID);
 
+	if (ec->fe) {
+		ecm_fe_point_get(ec, &p[0], a);
+		ecm_fe_point_get(ec, &p[1], b);
+		ecm_fe_point_get(ec, &p[2], c);
+		ecm_fe_diffadd(ec, &p[0], &p[1], &p[2]);
+		ecm_fe_point_put(ec, a, &p[0]);
+		return;
+	}
+
 	t[0] = bn_new_copy(b->x);
 	bn_add_mont(ec->mctx, t[0], b->z);
 	t[1] = bn_new_copy(b->x);
@@ -285,30 +521,38 @@ void ecm_diffadd(const struct ec_mont *ec, struct ec_point *a,
 
 void ecm_point_normalize(const struct ec_mont *ec, struct ec_point *a)
 {
+	struct ec_fe_point p;
+
 	assert(ec != EC_INVALID);
 	assert(a != EC_POINT_INVALID);
 
-	/*
-	 * Montgomery modular inverse.
-	 * For now, convert to normal, calculate, and convert back to
-	 * Montgomery form.
-	 */
-	bn_from_mont(ec->mctx, a->x);
-	bn_from_mont(ec->mctx, a->z);
+	if (ec->fe) {
+		ecm_fe_point_get(ec, &p, a);
+		ecm_fe_point_normalize(&p);
+		ecm_fe_point_put(ec, a, &p);
+		return;
+	}
 
 	/*
-	 * The inverse does not exist for a point with a->z == 0, or
-	 * the point of infinity.
+	 * All in Montgomery form. The inverse does not exist for a point
+	 * with a->z == 0, or the point of infinity.
 	 */
-	assert(bn_mod_inv(a->z, ec->prime) == 1);
-	bn_mul(a->x, a->z);
-	bn_mod(a->x, ec->prime);
+	bn_mod_inv_mont(ec->mctx, a->z);
+	bn_mul_mont(ec->mctx, a->x, a->z);
+	bn_copy(a->z, ec->mctx->one);
+}
 
-	bn_free(a->z);
-	a->z = bn_new_from_string_be("1", 16);
+/* Swap the points a and b if bit == 1, without branches. */
+static void ecm_point_cswap(struct ec_point **a, struct ec_point **b, int bit)
+{
+	uintptr_t mask, t;
+
+	assert(bit == 0 || bit == 1);
 
-	bn_to_mont(ec->mctx, a->x);
-	bn_to_mont(ec->mctx, a->z);
+	mask = -(uintptr_t)bit;
+	t = mask & ((uintptr_t)*a ^ (uintptr_t)*b);
+	*a = (struct ec_point *)((uintptr_t)*a ^ t);
+	*b = (struct ec_point *)((uintptr_t)*b ^ t);
 }
 
 /* All co-ordinates in projective, Montgomery form. */
@@ -316,8 +560,10 @@ void ecm_point_normalize(const struct ec_mont *ec, struct ec_point *a)
 void ecm_scale(const struct ec_mont *ec, struct ec_point **_a,
 	       const struct bn *b)
 {
-	int i, msb;
+	int i, n, msb, nbits, bit, swap;
+	uint8_t *s;
 	struct ec_point *pt[3], *a;
+	struct ec_fe_point p;
 
 	assert(ec != EC_INVALID);
 	assert(b != BN_INVALID);
@@ -327,28 +573,52 @@ void ecm_scale(const struct ec_mont *ec, struct ec_point **_a,
 	if (a == EC_POINT_INVALID)
 		a = ecm_point_new_copy(ec, &ec->gen);
 
+	/* The ladder runs over as many bits as the prime has. */
+	s = bn_to_bytes_le(b, &n);
+	nbits = bn_msb(ec->prime) + 1;
+	if (nbits < 8 * n)
+		nbits = 8 * n;
+
+	if (ec->fe) {
+		ecm_fe_point_get(ec, &p, a);
+		ecm_fe_scale(ec, &p, s, n, nbits);
+		ecm_fe_point_put(ec, a, &p);
+		memwipe(s, n);
+		free(s);
+		*_a = a;
+		return;
+	}
+
+	/*
+	 * The bn formulas are not fed the identity; the ladder starts at the
+	 * top set bit, with (a, 2a). The three points are allocated once.
+	 */
 	pt[0] = ecm_point_new_copy(ec, a);
 	pt[1] = ecm_point_new_copy(ec, a);
+	pt[2] = ecm_point_new_copy(ec, a);
 
 	ecm_dbl(ec, pt[1]);
 	msb = bn_msb(b);
+	swap = 0;
 
 	for (i = msb - 1; i >= 0; --i) {
+		bit = ec_bytes_bit(s, n, i);
+		ecm_point_cswap(&pt[0], &pt[1], swap ^ bit);
+		swap = bit;
+
 		/* Difference between pt[0] and pt[1] is always == a. */
-		pt[2] = ecm_point_new_copy(ec, a);
+		bn_copy(pt[2]->x, a->x);
+		bn_copy(pt[2]->z, a->z);
 		ecm_diffadd(ec, pt[2], pt[0], pt[1]);
-		if (bn_test_bit(b, i) == 0) {
-			ecm_dbl(ec, pt[0]);
-			ecm_point_free(ec, pt[1]);
-			pt[1] = pt[2];
-		} else {
-			ecm_dbl(ec, pt[1]);
-			ecm_point_free(ec, pt[0]);
-			pt[0] = pt[2];
-		}
+		ecm_dbl(ec, pt[0]);
+		ecm_point_cswap(&pt[1], &pt[2], 1);
 	}
+	ecm_point_cswap(&pt[0], &pt[1], swap);
 	ecm_point_free(ec, pt[1]);
+	ecm_point_free(ec, pt[2]);
 	ecm_point_free(ec, a);
+	memwipe(s, n);
+	free(s);
 	ecm_point_normalize(ec, pt[0]);
 	*_a = pt[0];
 }
@@ -359,16 +629,23 @@ void ecm_scale(const struct ec_mont *ec, struct ec_point **_a,
 
 
 
-/* Equal or not equal. */
-static int ece_points_equal(const struct ec_edwards *ec,
-			    const struct ec_point *a, const struct ec_point *b)
+/* (x, y) -> (-x, y). */
+static void ece_point_negate(const struct ec_edwards *ec, struct ec_point *a)
 {
-	assert(ec != EC_INVALID);
-	assert(a != EC_POINT_INVALID);
-	assert(b != EC_POINT_INVALID);
+	struct bn *t;
 
-	return (bn_cmp(a->x, b->x) == 0) && (bn_cmp(a->y, b->y) == 0) &&
-		(bn_cmp(a->z, b->z) == 0);
+	if (bn_is_zero(a->x))
+		return;
+	t = bn_new_copy(ec->prime);
+	bn_sub(t, a->x);
+	bn_free(a->x);
+	a->x = t;
+}
+
+/* The identity is (0 : z : z). */
+static int ece_point_is_identity(const struct ec_point *a)
+{
+	return bn_is_zero(a->x) && bn_cmp(a->y, a->z) == 0;
 }
 
 struct bn *ece_point_x(const struct ec_edwards *ec, const struct ec_point *a)
@@ -469,48 +746,692 @@ struct ec_point *ece_point_new_copy(const struct ec_edwards *ec,
 	return b;
 }
 
+/* (X : Y : Z) -> (XZ : YZ : Z^2 : XY). */
+static void ece_fe_point_get(const struct ec_edwards *ec,
+			     struct ec_fe_point *p, const struct ec_point *a)
+{
+	struct fe x, y, z;
+
+	ec_fe_from_mont(ec->fe, &x, a->x);
+	ec_fe_from_mont(ec->fe, &y, a->y);
+	ec_fe_from_mont(ec->fe, &z, a->z);
+	fe_mul(&p->x, &x, &z);
+	fe_mul(&p->y, &y, &z);
+	fe_sq(&p->z, &z);
+	fe_mul(&p->t, &x, &y);
+}
+
+/* T is dropped; (X : Y : Z) remains valid. */
+static void ece_fe_point_put(const struct ec_edwards *ec, struct ec_point *a,
+			     const struct ec_fe_point *p)
+{
+	bn_free(a->x);
+	bn_free(a->y);
+	bn_free(a->z);
+	a->x = ec_fe_to_mont(ec->fe, &p->x);
+	a->y = ec_fe_to_mont(ec->fe, &p->y);
+	a->z = ec_fe_to_mont(ec->fe, &p->z);
+}
+
+/* The identity, (0 : 1 : 1 : 0). */
+static void ece_fe_point_zero(struct ec_fe_point *a)
+{
+	fe_zero(&a->x);
+	fe_one(&a->y);
+	fe_one(&a->z);
+	fe_zero(&a->t);
+}
+
+/*
+ * The fe counterparts of ece_point_normalize, ece_dbl, ece_add. The
+ * formulas are those of Hisil, Wong, Carter and Dawson for a = -1, which
+ * ec_new_edwards checks before it sets up ec->fe.
+ */
+static void ece_fe_point_normalize(struct ec_fe_point *a)
+{
+	struct fe t;
+
+	fe_invert(&t, &a->z);
+	fe_mul(&a->x, &a->x, &t);
+	fe_mul(&a->y, &a->y, &t);
+	fe_one(&a->z);
+	fe_mul(&a->t, &a->x, &a->y);
+}
+
+/* dbl-2008-hwcd: 4M + 4S. T1 is not read. */
+static void ece_fe_dbl(const struct ec_edwards *ec, struct ec_fe_point *a)
+{
+	struct fe t[7];
+
+	(void)ec;
+
+	fe_sq(&t[0], &a->x);			/* A = X1^2 */
+	fe_sq(&t[1], &a->y);			/* B = Y1^2 */
+	fe_sq(&t[2], &a->z);
+	fe_add(&t[2], &t[2], &t[2]);		/* C = 2 * Z1^2 */
+	fe_add(&t[3], &a->x, &a->y);
+	fe_sq(&t[3], &t[3]);
+	fe_sub(&t[3], &t[3], &t[0]);
+	fe_sub(&t[3], &t[3], &t[1]);		/* E = (X1+Y1)^2 - A - B */
+	fe_sub(&t[4], &t[1], &t[0]);		/* G = -A + B */
+	fe_sub(&t[5], &t[4], &t[2]);		/* F = G - C */
+	fe_add(&t[6], &t[0], &t[1]);
+	fe_neg(&t[6], &t[6]);			/* H = -A - B */
+
+	fe_mul(&a->x, &t[3], &t[5]);		/* X3 = E * F */
+	fe_mul(&a->y, &t[4], &t[6]);		/* Y3 = G * H */
+	fe_mul(&a->t, &t[3], &t[6]);		/* T3 = E * H */
+	fe_mul(&a->z, &t[5], &t[4]);		/* Z3 = F * G */
+}
+
+static void ece_fe_to_cached(const struct ec_edwards *ec,
+			     struct ec_fe_cached *c, const struct ec_fe_point *p)
+{
+	fe_add(&c->ypx, &p->y, &p->x);
+	fe_sub(&c->ymx, &p->y, &p->x);
+	c->z = p->z;
+	fe_mul(&c->t2d, &p->t, &ec->fe->d2);
+}
+
+/* -(X : Y : Z : T) = (-X : Y : Z : -T). */
+static void ece_fe_cached_neg(struct ec_fe_cached *c)
+{
+	struct fe t;
+
+	t = c->ypx;
+	c->ypx = c->ymx;
+	c->ymx = t;
+	fe_neg(&c->t2d, &c->t2d);
+}
+
+/*
+ * The tail shared by the additions: from A, B, C, D of add-2008-hwcd-3,
+ * (X3 : Y3 : Z3 : T3) = (EF : GH : FG : EH).
+ */
+static void ece_fe_add_tail(struct ec_fe_point *a, const struct fe *t)
+{
+	struct fe e, f, g, h;
+
+	fe_sub(&e, &t[1], &t[0]);		/* E = B - A */
+	fe_sub(&f, &t[3], &t[2]);		/* F = D - C */
+	fe_add(&g, &t[3], &t[2]);		/* G = D + C */
+	fe_add(&h, &t[1], &t[0]);		/* H = B + A */
+
+	fe_mul(&a->x, &e, &f);
+	fe_mul(&a->y, &g, &h);
+	fe_mul(&a->t, &e, &h);
+	fe_mul(&a->z, &f, &g);
+}
+
+/* add-2008-hwcd-3, with 2dT2 precomputed: 8M. */
+static void ece_fe_add_cached(struct ec_fe_point *a,
+			      const struct ec_fe_cached *b)
+{
+	struct fe t[4], u;
+
+	fe_sub(&u, &a->y, &a->x);
+	fe_mul(&t[0], &u, &b->ymx);		/* A = (Y1-X1)*(Y2-X2) */
+	fe_add(&u, &a->y, &a->x);
+	fe_mul(&t[1], &u, &b->ypx);		/* B = (Y1+X1)*(Y2+X2) */
+	fe_mul(&t[2], &a->t, &b->t2d);		/* C = T1 * 2d * T2 */
+	fe_mul(&t[3], &a->z, &b->z);
+	fe_add(&t[3], &t[3], &t[3]);		/* D = 2 * Z1 * Z2 */
+	ece_fe_add_tail(a, t);
+}
+
+static void ece_fe_add(const struct ec_edwards *ec, struct ec_fe_point *a,
+		       const struct ec_fe_point *b)
+{
+	struct ec_fe_cached c;
+
+	ece_fe_to_cached(ec, &c, b);
+	ece_fe_add_cached(a, &c);
+}
+
+/* b < 2^255, as 32 little-endian bytes. */
+static void ec_scalar_bytes(uint8_t *s, const struct bn *b)
+{
+	int n;
+	uint8_t *bytes;
+
+	bytes = bn_to_bytes_le(b, &n);
+	assert(n <= 32);
+	memset(s, 0, 32);
+	memcpy(s, bytes, n);
+	/* The scalar may be a secret. */
+	memwipe(bytes, n);
+	free(bytes);
+	assert(s[31] < 0x80);
+}
+
+/* madd-2008-hwcd-3: as ece_fe_add_cached, with Z2 = 1. 7M. */
+static void ece_fe_madd(struct ec_fe_point *a, const struct ec_fe_niels *b)
+{
+	struct fe t[4], u;
+
+	fe_sub(&u, &a->y, &a->x);
+	fe_mul(&t[0], &u, &b->ymx);		/* A = (Y1-X1)*(y2-x2) */
+	fe_add(&u, &a->y, &a->x);
+	fe_mul(&t[1], &u, &b->ypx);		/* B = (Y1+X1)*(y2+x2) */
+	fe_mul(&t[2], &a->t, &b->xy2d);		/* C = T1 * 2d * x2 * y2 */
+	fe_add(&t[3], &a->z, &a->z);		/* D = 2 * Z1 */
+	ece_fe_add_tail(a, t);
+}
+
+/* -(x, y) = (-x, y): y + x and y - x trade places. */
+static void ece_fe_niels_neg(struct ec_fe_niels *b)
+{
+	struct fe t;
+
+	t = b->ypx;
+	b->ypx = b->ymx;
+	b->ymx = t;
+	fe_neg(&b->xy2d, &b->xy2d);
+}
+
+/* The n points, made affine with a single inversion, as (y + x, y - x, 2dxy). */
+static void ece_fe_batch_to_niels(const struct ec_edwards *ec,
+				  struct ec_fe_niels *out,
+				  const struct ec_fe_point *in, int n)
+{
+	int i;
+	struct fe *z, t, x, y;
+
+	assert(n > 0);
+
+	z = malloc(n * sizeof(*z));
+	assert(z);
+
+	for (i = 0; i < n; ++i)
+		z[i] = in[i].z;
+	ec_fe_batch_invert(z, n);
+
+	for (i = 0; i < n; ++i) {
+		fe_mul(&x, &in[i].x, &z[i]);
+		fe_mul(&y, &in[i].y, &z[i]);
+		fe_add(&out[i].ypx, &y, &x);
+		fe_sub(&out[i].ymx, &y, &x);
+		fe_mul(&t, &x, &y);
+		fe_mul(&out[i].xy2d, &t, &ec->fe->d2);
+	}
+	free(z);
+}
+
+/* t[j] = (2j + 1) * p. */
+static void ece_fe_odd_multiples(const struct ec_edwards *ec,
+				 struct ec_fe_point *t,
+				 const struct ec_fe_point *p)
+{
+	int j;
+	struct ec_fe_point p2;
+	struct ec_fe_cached c;
+
+	p2 = *p;
+	ece_fe_dbl(ec, &p2);
+	ece_fe_to_cached(ec, &c, &p2);
+	t[0] = *p;
+	for (j = 1; j < EC_FE_SLIDE_NPTS; ++j) {
+		t[j] = t[j - 1];
+		ece_fe_add_cached(&t[j], &c);
+	}
+}
+
+/* The odd multiples of G, for ece_fe_double_scale. */
+static void ece_fe_base_init(struct ec_edwards *ec)
+{
+	struct ec_fe_point g, pts[EC_FE_SLIDE_NPTS];
+
+	ece_fe_point_get(ec, &g, &ec->gen);
+	ece_fe_odd_multiples(ec, pts, &g);
+	ece_fe_batch_to_niels(ec, ec->fe->base_odd, pts, EC_FE_SLIDE_NPTS);
+}
+
+/*
+ * The comb of EC_FE_BASE_NROWS. Only signing needs it, so it is built on
+ * the first [b]G rather than with the curve. Threads that get here at the
+ * same time each build one; the first to publish its own wins, and the
+ * others free theirs.
+ */
+static const struct ec_fe_niels *ece_fe_base(const struct ec_edwards *ec)
+{
+	int i, j, n;
+	struct ec_fe_point g, *row, *pts;
+	struct ec_fe_cached c;
+	struct ec_fe_niels *base, *old;
+
+	base = atomic_load_explicit(&ec->fe->base, memory_order_acquire);
+	if (base)
+		return base;
+
+	n = EC_FE_BASE_NROWS * EC_FE_BASE_NCOLS;
+	pts = malloc(n * sizeof(*pts));
+	base = malloc(n * sizeof(*base));
+	assert(pts && base);
+
+	/* g = 16^(2i) * G. */
+	ece_fe_point_get(ec, &g, &ec->gen);
+	for (i = 0; i < EC_FE_BASE_NROWS; ++i) {
+		row = &pts[i * EC_FE_BASE_NCOLS];
+		row[0] = g;
+		ece_fe_to_cached(ec, &c, &g);
+		for (j = 1; j < EC_FE_BASE_NCOLS; ++j) {
+			row[j] = row[j - 1];
+			ece_fe_add_cached(&row[j], &c);
+		}
+
+		/* 256g = 2^5 * 8g. */
+		g = row[EC_FE_BASE_NCOLS - 1];
+		for (j = 0; j < 5; ++j)
+			ece_fe_dbl(ec, &g);
+	}
+	ece_fe_batch_to_niels(ec, base, pts, n);
+	free(pts);
+
+	old = NULL;
+	if (!atomic_compare_exchange_strong_explicit(&ec->fe->base, &old, base,
+						     memory_order_acq_rel,
+						     memory_order_acquire)) {
+		free(base);
+		base = old;
+	}
+	return base;
+}
+
+/*
+ * t = e * 16^(2i) * G, for e in [-8, 8]. The entire row is scanned, and
+ * the entries are picked without branches, as e is derived from a secret
+ * scalar when signing.
+ */
+static void ece_fe_base_select(const struct ec_fe_niels *base,
+			       struct ec_fe_niels *t, int i, int e)
+{
+	int j, neg, abs, eq;
+	struct ec_fe_niels n;
+	const struct ec_fe_niels *row;
+
+	neg = e < 0;
+	abs = e - 2 * (-neg & e);
+
+	/* The identity, (1, 1, 0). */
+	row = &base[i * EC_FE_BASE_NCOLS];
+	fe_one(&t->ypx);
+	fe_one(&t->ymx);
+	fe_zero(&t->xy2d);
+	for (j = 0; j < EC_FE_BASE_NCOLS; ++j) {
+		eq = (unsigned)((abs ^ (j + 1)) - 1) >> 31;
+		fe_cmov(&t->ypx, &row[j].ypx, eq);
+		fe_cmov(&t->ymx, &row[j].ymx, eq);
+		fe_cmov(&t->xy2d, &row[j].xy2d, eq);
+	}
+
+	n = *t;
+	ece_fe_niels_neg(&n);
+	fe_cmov(&t->ypx, &n.ypx, neg);
+	fe_cmov(&t->ymx, &n.ymx, neg);
+	fe_cmov(&t->xy2d, &n.xy2d, neg);
+}
+
+/*
+ * [b]G, with b < 2^255. b is recoded into 64 signed radix-16 digits e[i],
+ * so that b = sum e[i] * 16^i. With the odd digits summed first and then
+ * multiplied by 16, each of the 32 rows of the comb serves two digits:
+ * 64 mixed additions and 4 doublings in all.
+ */
+static void ece_fe_scale_base(const struct ec_edwards *ec,
+			      struct ec_fe_point *h, const struct bn *b)
+{
+	int i, carry;
+	int8_t e[64];
+	uint8_t s[32];
+	struct ec_fe_niels t;
+	const struct ec_fe_niels *base;
+
+	base = ece_fe_base(ec);
+	ec_scalar_bytes(s, b);
+
+	for (i = 0; i < 32; ++i) {
+		e[2 * i] = s[i] & 0xf;
+		e[2 * i + 1] = s[i] >> 4;
+	}
+
+	/* Each digit into [-8, 8). The top one ends up <= 8. */
+	carry = 0;
+	for (i = 0; i < 63; ++i) {
+		e[i] += carry;
+		carry = (e[i] + 8) >> 4;
+		e[i] -= carry << 4;
+	}
+	e[63] += carry;
+
+	ece_fe_point_zero(h);
+	for (i = 1; i < 64; i += 2) {
+		ece_fe_base_select(base, &t, i >> 1, e[i]);
+		ece_fe_madd(h, &t);
+	}
+
+	for (i = 0; i < 4; ++i)
+		ece_fe_dbl(ec, h);
+
+	for (i = 0; i < 64; i += 2) {
+		ece_fe_base_select(base, &t, i >> 1, e[i]);
+		ece_fe_madd(h, &t);
+	}
+	ece_fe_point_normalize(h);
+
+	/* b is a private scalar or a nonce, when signing. */
+	memwipe(s, sizeof(s));
+	memwipe(e, sizeof(e));
+	memwipe(&t, sizeof(t));
+}
+
+/*
+ * Sliding windows: b = sum e[i] * 2^i, where each e[i] is 0 or odd and in
+ * [-15, 15], and the non-zero digits are spread out. b < 2^255.
+ */
+static void ec_slide(int8_t *e, const struct bn *b)
+{
+	int i, j, k;
+	uint8_t s[32];
+
+	ec_scalar_bytes(s, b);
+	for (i = 0; i < 256; ++i)
+		e[i] = (s[i >> 3] >> (i & 7)) & 1;
+
+	for (i = 0; i < 256; ++i) {
+		if (e[i] == 0)
+			continue;
+		for (j = 1; j <= 6 && i + j < 256; ++j) {
+			if (e[i + j] == 0)
+				continue;
+			if (e[i] + (e[i + j] << j) <= 15) {
+				e[i] += e[i + j] << j;
+				e[i + j] = 0;
+			} else if (e[i] - (e[i + j] << j) >= -15) {
+				e[i] -= e[i + j] << j;
+				/* Carry the borrowed bit up. */
+				for (k = i + j; k < 256; ++k) {
+					if (e[k] == 0) {
+						e[k] = 1;
+						break;
+					}
+					e[k] = 0;
+				}
+			} else {
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * h = [s1]G + [s2]p2, by Straus: a single chain of doublings, with the
+ * sliding windows of both the scalars interleaved. Not constant-time;
+ * meant for verification, where the inputs are public.
+ */
+static void ece_fe_double_scale(const struct ec_edwards *ec,
+				struct ec_fe_point *h, const struct bn *s1,
+				const struct bn *s2,
+				const struct ec_fe_point *p2)
+{
+	int i;
+	int8_t e1[256], e2[256];
+	struct ec_fe_point t2[EC_FE_SLIDE_NPTS];
+	struct ec_fe_cached c2[EC_FE_SLIDE_NPTS], c;
+	struct ec_fe_niels t;
+
+	ec_slide(e1, s1);
+	ec_slide(e2, s2);
+	ece_fe_odd_multiples(ec, t2, p2);
+	for (i = 0; i < EC_FE_SLIDE_NPTS; ++i)
+		ece_fe_to_cached(ec, &c2[i], &t2[i]);
+
+	ece_fe_point_zero(h);
+
+	for (i = 255; i >= 0; --i)
+		if (e1[i] || e2[i])
+			break;
+
+	for (; i >= 0; --i) {
+		ece_fe_dbl(ec, h);
+
+		if (e1[i] > 0) {
+			ece_fe_madd(h, &ec->fe->base_odd[e1[i] >> 1]);
+		} else if (e1[i] < 0) {
+			t = ec->fe->base_odd[-e1[i] >> 1];
+			ece_fe_niels_neg(&t);
+			ece_fe_madd(h, &t);
+		}
+
+		if (e2[i] > 0) {
+			ece_fe_add_cached(h, &c2[e2[i] >> 1]);
+		} else if (e2[i] < 0) {
+			c = c2[-e2[i] >> 1];
+			ece_fe_cached_neg(&c);
+			ece_fe_add_cached(h, &c);
+		}
+	}
+	ece_fe_point_normalize(h);
+}
+
+/* Bits [w, w + c) of the 256-bit little-endian s. */
+static int ec_scalar_bits(const uint8_t *s, int w, int c)
+{
+	int i, d;
+
+	for (i = 0, d = 0; i < c && w + i < 256; ++i)
+		d |= ((s[(w + i) >> 3] >> ((w + i) & 7)) & 1) << i;
+	return d;
+}
+
+/*
+ * h = sum [s_i]p[i], by Pippenger's bucket method. s holds n scalars of 32
+ * bytes each, every one < 2^255. Per c-bit window, each point is added
+ * to the bucket of its digit; the buckets are then weighed by their
+ * digits with two running sums. Not constant-time.
+ */
+static void ece_fe_multi_scale(const struct ec_edwards *ec,
+			       struct ec_fe_point *h,
+			       const struct ec_fe_point *p, const uint8_t *s,
+			       int n)
+{
+	int i, j, w, c, d, nb, started;
+	char *used;
+	struct ec_fe_point *b, run, sum;
+	struct ec_fe_cached *pc;
+
+	for (c = 2; c < 12 && (1 << (c + 2)) <= n; ++c)
+		;
+	nb = (1 << c) - 1;
+	b = malloc(nb * sizeof(*b));
+	used = malloc(nb);
+	pc = malloc(n * sizeof(*pc));
+	assert(b && used && pc);
+
+	for (i = 0; i < n; ++i)
+		ece_fe_to_cached(ec, &pc[i], &p[i]);
+
+	ece_fe_point_zero(h);
+
+	for (w = (255 / c) * c; w >= 0; w -= c) {
+		for (i = 0; i < c; ++i)
+			ece_fe_dbl(ec, h);
+
+		memset(used, 0, nb);
+		for (i = 0; i < n; ++i) {
+			d = ec_scalar_bits(s + 32 * i, w, c);
+			if (d == 0)
+				continue;
+			if (used[d - 1]) {
+				ece_fe_add_cached(&b[d - 1], &pc[i]);
+			} else {
+				b[d - 1] = p[i];
+				used[d - 1] = 1;
+			}
+		}
+
+		/* sum = sum_d d * b[d - 1]. */
+		started = 0;
+		for (j = nb - 1; j >= 0; --j) {
+			if (!started) {
+				if (!used[j])
+					continue;
+				run = sum = b[j];
+				started = 1;
+				continue;
+			}
+			if (used[j])
+				ece_fe_add(ec, &run, &b[j]);
+			ece_fe_add(ec, &sum, &run);
+		}
+		if (started)
+			ece_fe_add(ec, h, &sum);
+	}
+	free(pc);
+	free(used);
+	free(b);
+}
+
+/* x == 0 and y == z. */
+static int ece_fe_is_identity(const struct ec_fe_point *a)
+{
+	uint8_t x[32], y[32], z[32], zero[32];
+
+	fe_to_bytes(x, &a->x);
+	fe_to_bytes(y, &a->y);
+	fe_to_bytes(z, &a->z);
+	memset(zero, 0, sizeof(zero));
+	return memcmp(x, zero, 32) == 0 && memcmp(y, z, 32) == 0;
+}
+
+static void ece_fe_scale(const struct ec_edwards *ec, struct ec_fe_point *a,
+			 const struct bn *b)
+{
+	int i, msb;
+	struct ec_fe_point pt;
+	struct ec_fe_cached c;
+
+	pt = *a;
+	msb = bn_msb(b);
+	assert(msb >= 0);
+
+	ece_fe_to_cached(ec, &c, a);
+	for (i = msb - 1; i >= 0; --i) {
+		ece_fe_dbl(ec, &pt);
+		if (bn_test_bit(b, i) == 1)
+			ece_fe_add_cached(&pt, &c);
+	}
+	ece_fe_point_normalize(&pt);
+	*a = pt;
+}
+
+/* (x : y : z) -> (x * zinv : y * zinv : 1). zinv may alias a->z. */
+static void ece_point_scale_zinv(const struct ec_edwards *ec,
+				 struct ec_point *a, const struct bn *zinv)
+{
+	bn_mul_mont(ec->mctx, a->x, zinv);
+	bn_mul_mont(ec->mctx, a->y, zinv);
+	bn_copy(a->z, ec->mctx->one);
+}
+
 void ece_point_normalize(const struct ec_edwards *ec, struct ec_point *a)
 {
+	struct ec_fe_point p;
+
 	assert(ec != EC_INVALID);
 	assert(a != EC_POINT_INVALID);
 
-	/*
-	 * Montgomery modular inverse.
-	 * For now, convert to normal, calculate, and convert back to
-	 * Montgomery form.
-	 */
-	bn_from_mont(ec->mctx, a->x);
-	bn_from_mont(ec->mctx, a->y);
-	bn_from_mont(ec->mctx, a->z);
+	if (ec->fe) {
+		ece_fe_point_get(ec, &p, a);
+		ece_fe_point_normalize(&p);
+		ece_fe_point_put(ec, a, &p);
+		return;
+	}
 
-	/*
-	 * The inverse does not exist for a point with a->z == 0, or
-	 * the point of infinity.
-	 */
-	assert(bn_mod_inv(a->z, ec->prime) == 1);
-	bn_mul(a->x, a->z);
-	bn_mul(a->y, a->z);
-	bn_mod(a->x, ec->prime);
-	bn_mod(a->y, ec->prime);
+	/* All in Montgomery form. z == 0 has no inverse. */
+	bn_mod_inv_mont(ec->mctx, a->z);
+	ece_point_scale_zinv(ec, a, a->z);
+}
 
-	bn_free(a->z);
-	a->z = bn_new_from_string_be("1", 16);
+/*
+ * Montgomery's trick: a single inversion for all the n points; the rest
+ * are 3 multiplications per point.
+ */
+void ece_point_normalize_batch(const struct ec_edwards *ec,
+			       struct ec_point *const *a, int n)
+{
+	int i;
+	struct fe *z;
+	struct ec_fe_point p;
+	struct bn **acc, *inv, *t;
+
+	assert(ec != EC_INVALID);
+	assert(a != NULL);
+	assert(n > 0);
+
+	if (ec->fe) {
+		z = malloc(n * sizeof(*z));
+		assert(z);
+		for (i = 0; i < n; ++i)
+			ec_fe_from_mont(ec->fe, &z[i], a[i]->z);
+		ec_fe_batch_invert(z, n);
+		for (i = 0; i < n; ++i) {
+			ec_fe_from_mont(ec->fe, &p.x, a[i]->x);
+			ec_fe_from_mont(ec->fe, &p.y, a[i]->y);
+			fe_mul(&p.x, &p.x, &z[i]);
+			fe_mul(&p.y, &p.y, &z[i]);
+			fe_one(&p.z);
+			ece_fe_point_put(ec, a[i], &p);
+		}
+		free(z);
+		return;
+	}
+
+	acc = malloc(n * sizeof(*acc));
+	assert(acc);
+
+	/* acc[i] = z[0] * ... * z[i]. */
+	acc[0] = bn_new_copy(a[0]->z);
+	for (i = 1; i < n; ++i) {
+		acc[i] = bn_new_copy(acc[i - 1]);
+		bn_mul_mont(ec->mctx, acc[i], a[i]->z);
+	}
 
-	bn_to_mont(ec->mctx, a->x);
-	bn_to_mont(ec->mctx, a->y);
-	bn_to_mont(ec->mctx, a->z);
+	inv = bn_new_copy(acc[n - 1]);
+	bn_mod_inv_mont(ec->mctx, inv);
+	for (i = n - 1; i > 0; --i) {
+		t = acc[i];
+		bn_copy(t, inv);
+		bn_mul_mont(ec->mctx, t, acc[i - 1]);	/* 1 / z[i] */
+		bn_mul_mont(ec->mctx, inv, a[i]->z);	/* 1 / acc[i - 1] */
+		ece_point_scale_zinv(ec, a[i], t);
+	}
+	ece_point_scale_zinv(ec, a[0], inv);
+
+	bn_free(inv);
+	for (i = 0; i < n; ++i)
+		bn_free(acc[i]);
+	free(acc);
 }
 
 /*
  * All co-ordinates in projective, Montgomery form. dbl-2008-bbjlp.
+ * With ec->fe, the point goes through the extended coordinates instead.
  */
 void ece_dbl(const struct ec_edwards *ec, struct ec_point *a)
 {
 	struct bn *t[7];
+	struct ec_fe_point p;
 
 	assert(ec != EC_INVALID);
 	assert(a != EC_POINT_INVALID);
 
+	if (ec->fe) {
+		ece_fe_point_get(ec, &p, a);
+		ece_fe_dbl(ec, &p);
+		ece_fe_point_put(ec, a, &p);
+		return;
+	}
+
 	t[0] = bn_new_copy(a->x);
 	bn_add_mont(ec->mctx, t[0], a->y);
 	bn_mul_mont(ec->mctx, t[0], t[0]);	/* B = (x + y)^2 */
@@ -556,16 +1477,26 @@ void ece_dbl(const struct ec_edwards *ec, struct ec_point *a)
 
 /*
  * All co-ordinates in projective, Montgomery form. add-2008-bbjlp.
+ * With ec->fe, the point goes through the extended coordinates instead.
  */
 void ece_add(const struct ec_edwards *ec, struct ec_point *a,
 	     const struct ec_point *b)
 {
 	struct bn *t[8];
+	struct ec_fe_point p[2];
 
 	assert(ec != EC_INVALID);
 	assert(a != EC_POINT_INVALID);
 	assert(b != EC_POINT_INVALID);
 
+	if (ec->fe) {
+		ece_fe_point_get(ec, &p[0], a);
+		ece_fe_point_get(ec, &p[1], b);
+		ece_fe_add(ec, &p[0], &p[1]);
+		ece_fe_point_put(ec, a, &p[0]);
+		return;
+	}
+
 	t[0] = bn_new_copy(a->z);
 	bn_mul_mont(ec->mctx, t[0], b->z);	/* A = Z1 * Z2 */
 
@@ -624,14 +1555,25 @@ void ece_scale(const struct ec_edwards *ec, struct ec_point **_a,
 {
 	int i, msb;
 	struct ec_point *pt, *a;
+	struct ec_fe_point p;
 
 	assert(ec != EC_INVALID);
 	assert(!bn_is_zero(b));
 	assert(_a != NULL);
 
 	a = *_a;
-	if (a == EC_POINT_INVALID)
-		a = ece_point_new_copy(ec, &ec->gen);
+	if (a == EC_POINT_INVALID) {
+		*_a = ece_scale_base(ec, b);
+		return;
+	}
+
+	if (ec->fe) {
+		ece_fe_point_get(ec, &p, a);
+		ece_fe_scale(ec, &p, b);
+		ece_fe_point_put(ec, a, &p);
+		*_a = a;
+		return;
+	}
 
 	pt = ece_point_new_copy(ec, a);
 	msb = bn_msb(b);
@@ -647,6 +1589,85 @@ void ece_scale(const struct ec_edwards *ec, struct ec_point **_a,
 	*_a = pt;
 }
 
+/* [b]G, normalized. Uses the comb, when available. */
+struct ec_point *ece_scale_base(const struct ec_edwards *ec,
+				const struct bn *b)
+{
+	struct ec_point *a;
+	struct ec_fe_point p;
+
+	assert(ec != EC_INVALID);
+	assert(!bn_is_zero(b));
+
+	a = ece_point_new_copy(ec, &ec->gen);
+	if (ec->fe && bn_msb(b) < 255) {
+		ece_fe_scale_base(ec, &p, b);
+		ece_fe_point_put(ec, a, &p);
+		return a;
+	}
+	ece_scale(ec, &a, b);
+	return a;
+}
+
+/*
+ * [s1]p1 + [s2]p2, normalized. p1 == EC_POINT_INVALID stands for the
+ * generator. The scalars may be zero. Not constant-time.
+ */
+struct ec_point *ece_double_scale(const struct ec_edwards *ec,
+				  const struct bn *s1,
+				  const struct ec_point *p1,
+				  const struct bn *s2,
+				  const struct ec_point *p2)
+{
+	int i, msb, b1, b2;
+	struct bn *zero, *one;
+	struct ec_point *a, *p12;
+	struct ec_fe_point p;
+
+	assert(ec != EC_INVALID);
+	assert(p2 != EC_POINT_INVALID);
+
+	if (p1 == EC_POINT_INVALID)
+		p1 = &ec->gen;
+
+	a = ece_point_new_copy(ec, p2);
+	if (ec->fe && p1 == &ec->gen && bn_msb(s1) < 255 &&
+	    bn_msb(s2) < 255) {
+		ece_fe_point_get(ec, &p, p2);
+		ece_fe_double_scale(ec, &p, s1, s2, &p);
+		ece_fe_point_put(ec, a, &p);
+		return a;
+	}
+
+	/* Shamir: one bit of each scalar per doubling; p1 + p2 is shared. */
+	p12 = ece_point_new_copy(ec, p1);
+	ece_add(ec, p12, p2);
+
+	/* a = (0 : 1 : 1). */
+	zero = bn_new_zero();
+	one = bn_new_from_int(1);
+	ece_point_free(ec, a);
+	a = ece_point_new(ec, zero, one);
+	bn_free(zero);
+	bn_free(one);
+
+	msb = bn_msb(s1) > bn_msb(s2) ? bn_msb(s1) : bn_msb(s2);
+	for (i = msb; i >= 0; --i) {
+		ece_dbl(ec, a);
+		b1 = i <= bn_msb(s1) && bn_test_bit(s1, i);
+		b2 = i <= bn_msb(s2) && bn_test_bit(s2, i);
+		if (b1 && b2)
+			ece_add(ec, a, p12);
+		else if (b1)
+			ece_add(ec, a, p1);
+		else if (b2)
+			ece_add(ec, a, p2);
+	}
+	ece_point_free(ec, p12);
+	ece_point_normalize(ec, a);
+	return a;
+}
+
 void ece_free(struct ec_edwards *ec)
 {
 	if (ec->prime != BN_INVALID)
@@ -665,6 +1686,11 @@ void ece_free(struct ec_edwards *ec)
 		bn_free(ec->gen.z);
 	if (ec->mctx)
 		bn_ctx_mont_free(ec->mctx);
+	if (ec->fe) {
+		free(atomic_load_explicit(&ec->fe->base,
+					  memory_order_relaxed));
+		free(ec->fe);
+	}
 	free(ec);
 }
 
@@ -681,6 +1707,7 @@ struct ec_edwards *ec_new_edwards(const struct ec_edwards_params *p)
 
 	ec->prime = ec->a = ec->d = ec->order = BN_INVALID;
 	ec->gen.x = ec->gen.y = ec->gen.z = BN_INVALID;
+	ec->fe = NULL;
 
 	/*
 	 * Order and Prime are kept as regular numbers.
@@ -716,6 +1743,19 @@ struct ec_edwards *ec_new_edwards(const struct ec_edwards_params *p)
 	bn_to_mont(ec->mctx, ec->gen.x);
 	bn_to_mont(ec->mctx, ec->gen.y);
 	bn_to_mont(ec->mctx, ec->gen.z);
+
+	if (ec_prime_is_25519(ec->prime)) {
+		ec->fe = ec_fe_new(ec->mctx, ec->a);
+		if (ec_fe_is_minus_one(&ec->fe->a)) {
+			ec_fe_from_mont(ec->fe, &ec->fe->d, ec->d);
+			fe_add(&ec->fe->d2, &ec->fe->d, &ec->fe->d);
+			ece_fe_base_init(ec);
+		} else {
+			/* The extended formulas of ece_fe_* need a = -1. */
+			free(ec->fe);
+			ec->fe = NULL;
+		}
+	}
 	return ec;
 err1:
 	for (i = 0; i < 7; ++i)
@@ -745,14 +1785,17 @@ err0:
 
 
 
-/* Input y coordinate in little-endian byte-array. */
-static struct ec_point *edc_point_decode(const struct edc *edc,
+/*
+ * Input y coordinate in little-endian byte-array. Returns EC_POINT_INVALID
+ * if y >= p, or if no point on the curve has y and the sign of x given.
+ */
+static struct ec_point *edc_point_decode(const struct ec_edwards *ec,
 					 const uint8_t *_y)
 {
-	int lsb;
+	int lsb, ok;
 	struct ec_point *pt;
 	struct bn *t[4], *prime, *one, *d, *x[2];
-	static uint8_t y[32];
+	uint8_t y[32];
 
 	memcpy(y, _y, 32);
 	lsb = 0;
@@ -766,7 +1809,13 @@ static struct ec_point *edc_point_decode(const struct edc *edc,
 	d = bn_new_from_string_be(ed25519_d_be, 16);
 
 	t[0] = bn_new_from_bytes_le(y, 32);
-	assert(bn_cmp_abs(t[0], prime) < 0);
+	if (bn_cmp_abs(t[0], prime) >= 0) {
+		bn_free(t[0]);
+		bn_free(one);
+		bn_free(prime);
+		bn_free(d);
+		return EC_POINT_INVALID;
+	}
 	t[3] = bn_new_copy(t[0]);
 
 	bn_mul(t[0], t[0]);
@@ -777,10 +1826,16 @@ static struct ec_point *edc_point_decode(const struct edc *edc,
 	bn_add(t[1], one);
 	bn_mod_inv(t[1], prime);
 
+	/* y^2 - 1, kept >= 0 for y == 0. */
 	t[2] = bn_new_copy(t[0]);
+	bn_add(t[2], prime);
 	bn_sub(t[2], one);
 	bn_mul(t[2], t[1]);
-	bn_mod_sqrt(t[2], prime);
+	bn_mod(t[2], prime);
+	ok = bn_mod_sqrt(t[2], prime);
+	/* x == 0 has no negative. */
+	if (ok && lsb && bn_is_zero(t[2]))
+		ok = 0;
 	bn_sub(prime, t[2]);
 
 	bn_free(t[0]);
@@ -788,6 +1843,13 @@ static struct ec_point *edc_point_decode(const struct edc *edc,
 	bn_free(one);
 	bn_free(d);
 
+	if (!ok) {
+		bn_free(prime);
+		bn_free(t[2]);
+		bn_free(t[3]);
+		return EC_POINT_INVALID;
+	}
+
 	if (bn_is_even(prime)) {
 		x[0] = prime;
 		x[1] = t[2];
@@ -796,7 +1858,7 @@ static struct ec_point *edc_point_decode(const struct edc *edc,
 		x[1] = prime;
 	}
 	bn_free(x[!lsb]);
-	pt = ece_point_new(edc->ec, x[lsb], t[3]);
+	pt = ece_point_new(ec, x[lsb], t[3]);
 	bn_free(x[lsb]);
 	bn_free(t[3]);
 	return pt;
@@ -825,50 +1887,46 @@ static void edc_point_encode(const struct edc *edc, uint8_t *out,
 	free(bytes);
 }
 
-struct edc *edc_new_verify(const uint8_t *pub)
+static struct ec_edwards *edc_ec_new()
 {
-	struct edc *edc;
 	struct ec_edwards_params eep;
 
-	edc = malloc(sizeof(*edc));
-	assert(edc);
-
 	eep.prime	= c25519_prime_be;
 	eep.order	= c25519_order_be;
 	eep.a		= ed25519_a_be;
 	eep.d		= ed25519_d_be;
 	eep.gx		= ed25519_gx_be;
 	eep.gy		= ed25519_gy_be;
+	return ec_new_edwards(&eep);
+}
+
+struct edc *edc_new_verify(const uint8_t *pub)
+{
+	struct edc *edc;
+
+	edc = malloc(sizeof(*edc));
+	assert(edc);
 
 	edc->to_sign = 0;
-	edc->ec = ec_new_edwards(&eep);
+	edc->ec = edc_ec_new();
 
 	memcpy(edc->pub, pub, 32);
-	edc->pt_pub = edc_point_decode(edc, edc->pub);
+	edc->pt_pub = edc_point_decode(edc->ec, edc->pub);
 	return edc;
 }
 
-/* static local variables here and elsewhere imply multithread nonsafety. */
 struct edc *edc_new_sign(const uint8_t *priv)
 {
 	struct edc *edc;
-	struct ec_edwards_params eep;
 	struct bn *t;
 	struct ec_point *pt;
-	static struct sha512_ctx ctx;
+	struct sha512_ctx ctx;
 
 	edc = malloc(sizeof(*edc));
 	assert(edc);
 
-	eep.prime	= c25519_prime_be;
-	eep.order	= c25519_order_be;
-	eep.a		= ed25519_a_be;
-	eep.d		= ed25519_d_be;
-	eep.gx		= ed25519_gx_be;
-	eep.gy		= ed25519_gy_be;
-
 	edc->to_sign = 1;
-	edc->ec = ec_new_edwards(&eep);
+	edc->ec = edc_ec_new();
 
 	sha512_init(&ctx);
 	sha512_update(&ctx, priv, 32);
@@ -880,9 +1938,9 @@ struct edc *edc_new_sign(const uint8_t *priv)
 	edc->priv_dgst[31] |= 0x40;
 
 	/* Scale. */
-	pt = EC_POINT_INVALID;
 	t = bn_new_from_bytes_le(edc->priv_dgst, 32);
-	ece_scale(edc->ec, &pt, t);
+	bn_set_secret(t);
+	pt = ece_scale_base(edc->ec, t);
 	bn_free(t);
 
 	/* Encode. */
@@ -894,7 +1952,8 @@ struct edc *edc_new_sign(const uint8_t *priv)
 void edc_free(struct edc *edc)
 {
 	assert(edc != EDC_INVALID);
-	ece_point_free(edc->ec, edc->pt_pub);
+	if (edc->pt_pub != EC_POINT_INVALID)
+		ece_point_free(edc->ec, edc->pt_pub);
 	ece_free(edc->ec);
 	free(edc);
 }
@@ -906,8 +1965,8 @@ void edc_sign(const struct edc *edc, uint8_t *tag, const uint8_t *msg,
 	uint8_t *bytes;
 	struct bn *ord, *r, *k, *s;
 	struct ec_point *pt;
-	static struct sha512_ctx ctx;
-	static uint8_t dgst[SHA512_DIGEST_LEN];
+	struct sha512_ctx ctx;
+	uint8_t dgst[SHA512_DIGEST_LEN];
 
 	assert(edc != EDC_INVALID);
 	assert(tag);
@@ -928,11 +1987,11 @@ void edc_sign(const struct edc *edc, uint8_t *tag, const uint8_t *msg,
 
 	/* r == little-endian integer out of dgst. */
 	r = bn_new_from_bytes_le(dgst, SHA512_DIGEST_LEN);
+	bn_set_secret(r);
 	bn_mod(r, ord);
 
 	/* R = [r]B */
-	pt = EC_POINT_INVALID;
-	ece_scale(edc->ec, &pt, r);
+	pt = ece_scale_base(edc->ec, r);
 	edc_point_encode(edc, dgst, pt);
 	ece_point_free(edc->ec, pt);
 	memcpy(tag, dgst, 32);			/* output R */
@@ -948,6 +2007,7 @@ void edc_sign(const struct edc *edc, uint8_t *tag, const uint8_t *msg,
 	bn_mod(k, ord);
 
 	s = bn_new_from_bytes_le(edc->priv_dgst, 32);
+	bn_set_secret(s);
 	bn_mul(s, k);
 	bn_add(s, r);
 	bn_mod(s, ord);				/* S */
@@ -962,62 +2022,243 @@ void edc_sign(const struct edc *edc, uint8_t *tag, const uint8_t *msg,
 	bn_free(ord);
 }
 
-/* The last 64 bytes of the msg contain the tag. */
-void edc_verify(const struct edc *edc, const uint8_t *msg, int mlen)
+/*
+ * The last 64 bytes of the msg contain the tag, R || S. Decodes R, and
+ * computes k = H(R || A || M) mod L. Returns 0 if there is no tag, if S is
+ * not reduced, or if R does not decode.
+ */
+static int edc_parse(const struct ec_edwards *ec, const uint8_t *pub,
+		     const uint8_t *msg, int mlen, struct ec_point **R,
+		     struct bn **S, struct bn **k)
 {
 	const uint8_t *r, *s;
-	struct bn *ord, *k, *S, *eight;
-	struct ec_point *R, *pt[3];
-	static struct sha512_ctx ctx;
-	static uint8_t dgst[SHA512_DIGEST_LEN];
-
-	assert(edc != EDC_INVALID);
-	assert(mlen >= 64);
-	/* Verification can be done by a context meant for signing. */
-	assert(edc->to_sign == 0 || edc->to_sign == 1);
+	uint8_t dgst[SHA512_DIGEST_LEN];
+	struct sha512_ctx ctx;
 
-	ord = bn_new_from_string_be(c25519_order_be, 16);
-	eight = bn_new_from_int(8);
+	if (mlen < 64)
+		return 0;
 
 	mlen -= 64;
 	r = msg + mlen;
 	s = r + 32;
 
-	/* R = [r]B */
-	R = edc_point_decode(edc, r);
-	S = bn_new_from_bytes_le(s, 32);
-	assert(bn_cmp_abs(S, ord) < 0);
+	*S = bn_new_from_bytes_le(s, 32);
+	if (bn_cmp_abs(*S, ec->order) >= 0) {
+		bn_free(*S);
+		return 0;
+	}
+	*R = edc_point_decode(ec, r);
+	if (*R == EC_POINT_INVALID) {
+		bn_free(*S);
+		return 0;
+	}
 
 	sha512_init(&ctx);
 	sha512_update(&ctx, r, 32);		/* R */
-	sha512_update(&ctx, edc->pub, 32);	/* A */
+	sha512_update(&ctx, pub, 32);		/* A */
 	sha512_update(&ctx, msg, mlen);		/* M */
 	sha512_final(&ctx, dgst);
 
 	/* k == little-endian integer out of dgst. */
-	k = bn_new_from_bytes_le(dgst, SHA512_DIGEST_LEN);
-	bn_mod(k, ord);
+	*k = bn_new_from_bytes_le(dgst, SHA512_DIGEST_LEN);
+	bn_mod(*k, ec->order);
+	return 1;
+}
 
-	pt[0] = EC_POINT_INVALID;
-	ece_scale(edc->ec, &pt[0], S);
-	ece_scale(edc->ec, &pt[0], eight);	/* 8*S*B */
+/* A is the decoded pub; invalid if pub did not decode. */
+static int edc_check(const struct ec_edwards *ec, const struct ec_point *A,
+		     const uint8_t *pub, const uint8_t *msg, int mlen)
+{
+	int i, ret;
+	struct bn *S, *k, *t;
+	struct ec_point *R, *pt;
 
-	pt[1] = R;
-	ece_scale(edc->ec, &pt[1], eight);
+	if (A == EC_POINT_INVALID)
+		return 0;
 
-	pt[2] = ece_point_new_copy(edc->ec, edc->pt_pub);
-	ece_scale(edc->ec, &pt[2], k);
-	ece_scale(edc->ec, &pt[2], eight);
+	if (!edc_parse(ec, pub, msg, mlen, &R, &S, &k))
+		return 0;
 
-	ece_add(edc->ec, pt[1], pt[2]);
-	ece_point_normalize(edc->ec, pt[1]);
-	assert(ece_points_equal(edc->ec, pt[0], pt[1]));
+	/*
+	 * [8][S]B == [8]R + [8][k]A, checked as [8]([S]B + [L - k]A - R) == O.
+	 * [L - k]A differs from -[k]A only by a point of small order, which
+	 * the multiplication by the cofactor 8 clears.
+	 */
+	t = bn_new_copy(ec->order);
+	bn_sub(t, k);
+	pt = ece_double_scale(ec, S, EC_POINT_INVALID, t, A);
+	ece_point_negate(ec, R);
+	ece_add(ec, pt, R);
+	for (i = 0; i < 3; ++i)
+		ece_dbl(ec, pt);
+	ret = ece_point_is_identity(pt);
 
-	ece_point_free(edc->ec, pt[0]);
-	ece_point_free(edc->ec, pt[1]);
-	ece_point_free(edc->ec, pt[2]);
+	ece_point_free(ec, pt);
+	ece_point_free(ec, R);
 	bn_free(S);
-	bn_free(eight);
 	bn_free(k);
-	bn_free(ord);
+	bn_free(t);
+	return ret;
+}
+
+/* The last 64 bytes of the msg contain the tag. Returns 1 if valid. */
+int edc_verify(const struct edc *edc, const uint8_t *msg, int mlen)
+{
+	assert(edc != EDC_INVALID);
+	assert(msg);
+	/* Verification can be done by a context meant for signing. */
+	assert(edc->to_sign == 0 || edc->to_sign == 1);
+
+	return edc_check(edc->ec, edc->pt_pub, edc->pub, msg, mlen);
+}
+
+/*
+ * The 128-bit z_i, 16 bytes each, as SHA-512(H || i) with H the SHA-512 of
+ * all the pubs and msgs. A forger must fix the tags before learning the z_i,
+ * so cannot make their errors cancel. A PRNG that can be guessed, or
+ * replayed, would let them.
+ */
+static void edc_batch_z(const uint8_t *const *pubs,
+			const uint8_t *const *msgs, const int *mlens, int n,
+			uint8_t *z)
+{
+	int i;
+	uint8_t h[SHA512_DIGEST_LEN], dgst[SHA512_DIGEST_LEN], ix[4];
+	struct sha512_ctx ctx;
+
+	sha512_init(&ctx);
+	for (i = 0; i < n; ++i) {
+		assert(mlens[i] >= 0);
+		ix[0] = mlens[i];
+		ix[1] = mlens[i] >> 8;
+		ix[2] = mlens[i] >> 16;
+		ix[3] = mlens[i] >> 24;
+		sha512_update(&ctx, pubs[i], 32);
+		sha512_update(&ctx, ix, sizeof(ix));
+		sha512_update(&ctx, msgs[i], mlens[i]);
+	}
+	sha512_final(&ctx, h);
+
+	for (i = 0; i < n; ++i) {
+		ix[0] = i;
+		ix[1] = i >> 8;
+		ix[2] = i >> 16;
+		ix[3] = i >> 24;
+		sha512_init(&ctx);
+		sha512_update(&ctx, h, sizeof(h));
+		sha512_update(&ctx, ix, sizeof(ix));
+		sha512_final(&ctx, dgst);
+		memcpy(z + 16 * i, dgst, 16);
+	}
+}
+
+/*
+ * Checks all the n tags at once, as
+ * [8](-[sum z_i S_i]B + sum [z_i]R_i + sum [z_i k_i]A_i) == O,
+ * for the 128-bit z_i of edc_batch_z, with a single multi-scalar
+ * multiplication over the 2n + 1 points. If that fails, the tags are
+ * checked one by one to find the failures.
+ *
+ * Each msgs[i] is of mlens[i] bytes and carries its tag at the end, as
+ * with edc_verify; pubs[i] is its 32-byte public key. res[i] is set to 1
+ * if the ith tag is valid. Returns 1 if all of them are.
+ *
+ * Only the curve of edc is used, and not its key; so any context, for
+ * signing or for verifying, can serve all the batches.
+ */
+int edc_verify_batch(const struct edc *edc, const uint8_t *const *pubs,
+		     const uint8_t *const *msgs, const int *mlens, int n,
+		     int *res)
+{
+	int i, ok, np;
+	uint8_t *z, *s;
+	struct bn *S, *k, *zi, *sb;
+	struct ec_point *A, *R;
+	const struct ec_edwards *ec;
+	struct ec_fe_point *pts, h;
+
+	assert(edc != EDC_INVALID);
+	assert(pubs && msgs && mlens && res);
+	assert(n > 0);
+
+	ec = edc->ec;
+	assert(ec->fe);
+
+	np = 2 * n + 1;
+	pts = malloc(np * sizeof(*pts));
+	s = malloc(np * 32);
+	z = malloc(n * 16);
+	assert(pts && s && z);
+
+	edc_batch_z(pubs, msgs, mlens, n, z);
+
+	/* The points are kept as fe only, to go easy on the bn pool. */
+	ok = 1;
+	sb = bn_new_zero();
+	for (i = 0; i < n && ok; ++i) {
+		A = edc_point_decode(ec, pubs[i]);
+		if (A == EC_POINT_INVALID) {
+			ok = 0;
+			break;
+		}
+		if (!edc_parse(ec, pubs[i], msgs[i], mlens[i], &R, &S, &k)) {
+			ece_point_free(ec, A);
+			ok = 0;
+			break;
+		}
+		ece_fe_point_get(ec, &pts[2 * i + 1], R);
+		ece_fe_point_get(ec, &pts[2 * i + 2], A);
+		ece_point_free(ec, R);
+		ece_point_free(ec, A);
+
+		zi = bn_new_from_bytes_le(z + 16 * i, 16);
+		ec_scalar_bytes(s + 32 * (2 * i + 1), zi);	/* R_i */
+
+		bn_mul(k, zi);
+		bn_mod(k, ec->order);
+		ec_scalar_bytes(s + 32 * (2 * i + 2), k);	/* A_i */
+
+		bn_mul(S, zi);
+		bn_add(sb, S);
+
+		bn_free(zi);
+		bn_free(S);
+		bn_free(k);
+	}
+
+	if (ok) {
+		/* B, with L - (sum z_i S_i mod L). */
+		memset(s, 0, 32);
+		bn_mod(sb, ec->order);
+		if (!bn_is_zero(sb)) {
+			S = bn_new_copy(ec->order);
+			bn_sub(S, sb);
+			ec_scalar_bytes(s, S);
+			bn_free(S);
+		}
+		ece_fe_point_get(ec, &pts[0], &ec->gen);
+
+		ece_fe_multi_scale(ec, &h, pts, s, np);
+		for (i = 0; i < 3; ++i)
+			ece_fe_dbl(ec, &h);
+		ok = ece_fe_is_identity(&h);
+	}
+
+	/* Find the failures. */
+	for (i = 0; i < n; ++i) {
+		if (ok) {
+			res[i] = 1;
+			continue;
+		}
+		A = edc_point_decode(ec, pubs[i]);
+		res[i] = edc_check(ec, A, pubs[i], msgs[i], mlens[i]);
+		if (A != EC_POINT_INVALID)
+			ece_point_free(ec, A);
+	}
+
+	bn_free(sb);
+	free(z);
+	free(s);
+	free(pts);
+	return ok;
 }
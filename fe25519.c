@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <sys/bn.h>
+#include <sys/fe25519.h>
+
+/* Arithmetic in GF(2^255 - 19), in radix 2^25.5. See sys/fe25519.h. */
+
+#define FE_NLIMBS			10
+
+/* Limb i holds 26 bits if i is even, 25 bits if odd. */
+static int fe_width(int i)
+{
+	return 26 - (i & 1);
+}
+
+static uint32_t fe_load32(const uint8_t *s)
+{
+	uint32_t v;
+
+	v  = (uint32_t)s[0];
+	v |= (uint32_t)s[1] << 8;
+	v |= (uint32_t)s[2] << 16;
+	v |= (uint32_t)s[3] << 24;
+	return v;
+}
+
+/*
+ * Carry t into h. Each carry is rounded to the nearest, so that the limbs
+ * end up centered around 0. The carry out of the top limb wraps around to
+ * the bottom as a multiple of 19, since 2^255 == 19 mod p.
+ */
+static void fe_reduce(struct fe *h, int64_t *t)
+{
+	int i, w;
+	int64_t c;
+
+	for (i = 0; i < FE_NLIMBS; ++i) {
+		w = fe_width(i);
+		c = (t[i] + ((int64_t)1 << (w - 1))) >> w;
+		t[i] -= c * ((int64_t)1 << w);
+		if (i < FE_NLIMBS - 1)
+			t[i + 1] += c;
+		else
+			t[0] += c * 19;
+	}
+
+	/* The wrap-around may have pushed the bottom limb out of range. */
+	c = (t[0] + ((int64_t)1 << 25)) >> 26;
+	t[0] -= c * ((int64_t)1 << 26);
+	t[1] += c;
+
+	for (i = 0; i < FE_NLIMBS; ++i)
+		h->v[i] = t[i];
+}
+
+void fe_zero(struct fe *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void fe_one(struct fe *h)
+{
+	fe_zero(h);
+	h->v[0] = 1;
+}
+
+/* No carries. h may alias f or g. */
+void fe_add(struct fe *h, const struct fe *f, const struct fe *g)
+{
+	int i;
+
+	for (i = 0; i < FE_NLIMBS; ++i)
+		h->v[i] = f->v[i] + g->v[i];
+}
+
+void fe_sub(struct fe *h, const struct fe *f, const struct fe *g)
+{
+	int i;
+
+	for (i = 0; i < FE_NLIMBS; ++i)
+		h->v[i] = f->v[i] - g->v[i];
+}
+
+void fe_neg(struct fe *h, const struct fe *f)
+{
+	int i;
+
+	for (i = 0; i < FE_NLIMBS; ++i)
+		h->v[i] = -f->v[i];
+}
+
+/*
+ * Schoolbook. The product of limbs i and j has the weight of limb i + j,
+ * doubled when both i and j are odd (25.5 * i is rounded up for the odd
+ * limbs). The terms at or beyond limb 10 are folded back with a * 19.
+ *
+ * With |f|, |g| < 2^27, each term is < 2^59.25 and each column < 2^62.6.
+ */
+void fe_mul(struct fe *h, const struct fe *f, const struct fe *g)
+{
+	int i, j, k;
+	int64_t t[FE_NLIMBS], v;
+
+	memset(t, 0, sizeof(t));
+	for (i = 0; i < FE_NLIMBS; ++i) {
+		for (j = 0; j < FE_NLIMBS; ++j) {
+			v = (int64_t)f->v[i] * g->v[j];
+			if (i & j & 1)
+				v *= 2;
+			k = i + j;
+			if (k >= FE_NLIMBS) {
+				v *= 19;
+				k -= FE_NLIMBS;
+			}
+			t[k] += v;
+		}
+	}
+	fe_reduce(h, t);
+}
+
+/* As fe_mul, but the cross terms are computed once and doubled. */
+void fe_sq(struct fe *h, const struct fe *f)
+{
+	int i, j, k;
+	int64_t t[FE_NLIMBS], v;
+
+	memset(t, 0, sizeof(t));
+	for (i = 0; i < FE_NLIMBS; ++i) {
+		for (j = i; j < FE_NLIMBS; ++j) {
+			v = (int64_t)f->v[i] * f->v[j];
+			if (i != j)
+				v *= 2;
+			if (i & j & 1)
+				v *= 2;
+			k = i + j;
+			if (k >= FE_NLIMBS) {
+				v *= 19;
+				k -= FE_NLIMBS;
+			}
+			t[k] += v;
+		}
+	}
+	fe_reduce(h, t);
+}
+
+/* h = f^(2^n). */
+static void fe_sqn(struct fe *h, const struct fe *f, int n)
+{
+	int i;
+
+	assert(n > 0);
+	fe_sq(h, f);
+	for (i = 1; i < n; ++i)
+		fe_sq(h, h);
+}
+
+/*
+ * Fermat: z^(p - 2), with p - 2 = 2^255 - 21. The addition chain builds
+ * z^(2^k - 1) for k = 5, 10, 20, 40, 50, 100, 200, 250; 254 squarings and
+ * 11 multiplications in all.
+ */
+void fe_invert(struct fe *h, const struct fe *z)
+{
+	struct fe t0, t1, t2, t3;
+
+	fe_sq(&t0, z);			/* 2 */
+	fe_sqn(&t1, &t0, 2);		/* 8 */
+	fe_mul(&t1, z, &t1);		/* 9 */
+	fe_mul(&t0, &t0, &t1);		/* 11 */
+	fe_sq(&t2, &t0);		/* 22 */
+	fe_mul(&t1, &t1, &t2);		/* 2^5 - 1 */
+	fe_sqn(&t2, &t1, 5);
+	fe_mul(&t1, &t2, &t1);		/* 2^10 - 1 */
+	fe_sqn(&t2, &t1, 10);
+	fe_mul(&t2, &t2, &t1);		/* 2^20 - 1 */
+	fe_sqn(&t3, &t2, 20);
+	fe_mul(&t2, &t3, &t2);		/* 2^40 - 1 */
+	fe_sqn(&t2, &t2, 10);
+	fe_mul(&t1, &t2, &t1);		/* 2^50 - 1 */
+	fe_sqn(&t2, &t1, 50);
+	fe_mul(&t2, &t2, &t1);		/* 2^100 - 1 */
+	fe_sqn(&t3, &t2, 100);
+	fe_mul(&t2, &t3, &t2);		/* 2^200 - 1 */
+	fe_sqn(&t2, &t2, 50);
+	fe_mul(&t1, &t2, &t1);		/* 2^250 - 1 */
+	fe_sqn(&t1, &t1, 5);		/* 2^255 - 32 */
+	fe_mul(h, &t1, &t0);		/* 2^255 - 21 */
+}
+
+/* h = g if b == 1, h is unchanged if b == 0. Without branches. */
+void fe_cmov(struct fe *h, const struct fe *g, int b)
+{
+	int i;
+	int32_t mask;
+
+	assert(b == 0 || b == 1);
+
+	mask = -b;
+	for (i = 0; i < FE_NLIMBS; ++i)
+		h->v[i] ^= mask & (h->v[i] ^ g->v[i]);
+}
+
+/* f and g are swapped if b == 1, unchanged if b == 0. Without branches. */
+void fe_cswap(struct fe *f, struct fe *g, int b)
+{
+	int i;
+	int32_t mask, t;
+
+	assert(b == 0 || b == 1);
+
+	mask = -b;
+	for (i = 0; i < FE_NLIMBS; ++i) {
+		t = mask & (f->v[i] ^ g->v[i]);
+		f->v[i] ^= t;
+		g->v[i] ^= t;
+	}
+}
+
+void fe_from_bytes(struct fe *h, const uint8_t *s)
+{
+	int i, off, w;
+
+	for (i = 0, off = 0; i < FE_NLIMBS; ++i, off += w) {
+		w = fe_width(i);
+		h->v[i] = (fe_load32(s + (off >> 3)) >> (off & 7)) &
+			  (((uint32_t)1 << w) - 1);
+	}
+}
+
+void fe_to_bytes(uint8_t *s, const struct fe *h)
+{
+	int i, j, w, nbits;
+	int64_t t[FE_NLIMBS], q;
+	uint64_t acc;
+
+	for (i = 0; i < FE_NLIMBS; ++i)
+		t[i] = h->v[i];
+
+	/*
+	 * q = floor(h / p), which is either 0 or 1 for a reduced h. Then
+	 * h - q * p = h + 19 * q - q * 2^255; the last term is dropped with
+	 * the final carry out of the top limb.
+	 */
+	q = (19 * t[FE_NLIMBS - 1] + ((int64_t)1 << 24)) >> 25;
+	for (i = 0; i < FE_NLIMBS; ++i)
+		q = (t[i] + q) >> fe_width(i);
+
+	t[0] += 19 * q;
+	for (i = 0; i < FE_NLIMBS; ++i) {
+		w = fe_width(i);
+		q = t[i] >> w;
+		t[i] -= q * ((int64_t)1 << w);
+		if (i < FE_NLIMBS - 1)
+			t[i + 1] += q;
+	}
+
+	/* Pack the 255 bits. */
+	acc = 0;
+	nbits = 0;
+	for (i = 0, j = 0; i < FE_NLIMBS; ++i) {
+		acc |= (uint64_t)t[i] << nbits;
+		nbits += fe_width(i);
+		for (; nbits >= 8; nbits -= 8) {
+			s[j++] = acc;
+			acc >>= 8;
+		}
+	}
+	assert(j == 31);
+	s[j] = acc;
+}
+
+void fe_from_bn(struct fe *h, const struct bn *b)
+{
+	int i, n;
+	uint8_t s[32];
+	limb_t v;
+
+	assert(b != BN_INVALID);
+	assert(b->neg == 0);
+	assert(bn_msb(b) < 255);
+
+	memset(s, 0, sizeof(s));
+	n = b->nsig << LIMB_BYTES_LOG;
+	if (n > 32)
+		n = 32;
+	for (i = 0; i < n; ++i) {
+		v = b->l->l[i >> LIMB_BYTES_LOG];
+		s[i] = v >> ((i & LIMB_BYTES_MASK) << 3);
+	}
+	fe_from_bytes(h, s);
+}
+
+struct bn *fe_to_bn(const struct fe *h)
+{
+	int i;
+	uint8_t s[32], be[32];
+
+	fe_to_bytes(s, h);
+	for (i = 0; i < 32; ++i)
+		be[i] = s[31 - i];
+	return bn_new_from_bytes_be(be, sizeof(be));
+}
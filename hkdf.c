@@ -14,10 +14,11 @@
 void hkdf_sha256_extract(uint8_t *out, const void *salt, int slen,
 			 const void *ikm, int klen)
 {
-	static struct hmac_sha256_ctx hmac;
+	struct hmac_sha256_ctx hmac;
 
 	assert(out);
 	assert(slen >= 0);
+	assert(klen >= 0);
 
 	if (salt == NULL || slen == 0) {
 		/* prk is assumed to be at least SHA256_DIGEST_LEN sized. */
@@ -33,18 +34,32 @@ void hkdf_sha256_extract(uint8_t *out, const void *salt, int slen,
 
 void hkdf_sha256_expand(uint8_t *out, int olen, const void *prk, int plen,
 			const void *info, int ilen)
+{
+	struct hmac_sha256_key key;
+
+	assert(plen >= 0);
+	assert(plen <= SHA256_DIGEST_LEN);
+
+	hmac_sha256_key_init(&key, prk, plen);
+	hkdf_sha256_expand_key(out, olen, &key, info, ilen);
+	hmac_sha256_key_fini(&key);
+}
+
+void hkdf_sha256_expand_key(uint8_t *out, int olen,
+			    const struct hmac_sha256_key *prk,
+			    const void *info, int ilen)
 {
 	int n, i;
 	uint8_t dgst[SHA256_DIGEST_LEN], cntr;
-	static struct hmac_sha256_ctx hmac;
+	struct hmac_sha256_ctx hmac;
 
+	assert(prk);
 	assert(ilen >= 0);
 	assert(olen >= 0);
-	assert(plen <= SHA256_DIGEST_LEN);
 
 	for (i = 1; olen; ++i) {
 		n = olen < SHA256_DIGEST_LEN ? olen : SHA256_DIGEST_LEN;
-		hmac_sha256_init(&hmac, prk, plen);
+		hmac_sha256_init_from_key(&hmac, prk);
 		if (i > 1)
 			hmac_sha256_update(&hmac, dgst, sizeof(dgst));
 		if (info && ilen)
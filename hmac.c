@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <bytes.h>
 #include <sys/hmac.h>
 
 static const uint8_t opad[SHA256_BLOCK_LEN] = {
@@ -32,37 +33,65 @@ static const uint8_t ipad[SHA256_BLOCK_LEN] = {
 	0x36,0x36,0x36,0x36,0x36,0x36,0x36,0x36
 };
 
-void hmac_sha256_init(struct hmac_sha256_ctx *ctx, const void *key, int klen)
+void hmac_sha256_key_init(struct hmac_sha256_key *key, const void *bytes,
+			  int klen)
 {
 	int i;
+	uint8_t k[SHA256_BLOCK_LEN];
 	uint8_t blk[SHA256_BLOCK_LEN];
-	uint8_t dgst[SHA256_DIGEST_LEN];
 	struct hmac_sha256 *c;
-	struct sha256_ctx *hc;
 
-	c = (struct hmac_sha256 *)ctx;
+	c = (struct hmac_sha256 *)key;
 
 	assert(c != NULL);
-	assert(sizeof(*ctx) == sizeof(*c));
-
-	hc = &c->sha256;
+	assert(sizeof(*key) == sizeof(*c));
+	assert(klen >= 0);
 
-	memset(c->k, 0, sizeof(c->k));
+	memset(k, 0, sizeof(k));
 	if (klen > SHA256_BLOCK_LEN) {
-		sha256_init(hc);
-		sha256_update(hc, key, klen);
-		sha256_final(hc, dgst);
-		memcpy(c->k, dgst, sizeof(dgst));
-	} else {
-		memcpy(c->k, key, klen);
+		sha256_init(&c->inner);
+		sha256_update(&c->inner, bytes, klen);
+		sha256_final(&c->inner, k);
+	} else if (klen) {
+		memcpy(k, bytes, klen);
 	}
 
-	memcpy(blk, c->k, SHA256_BLOCK_LEN);
 	for (i = 0; i < SHA256_BLOCK_LEN; ++i)
-		blk[i] ^= ipad[i];
+		blk[i] = k[i] ^ ipad[i];
+	sha256_init(&c->inner);
+	sha256_update(&c->inner, blk, sizeof(blk));
+
+	for (i = 0; i < SHA256_BLOCK_LEN; ++i)
+		blk[i] = k[i] ^ opad[i];
+	sha256_init(&c->outer);
+	sha256_update(&c->outer, blk, sizeof(blk));
+
+	memwipe(k, sizeof(k));
+	memwipe(blk, sizeof(blk));
+}
+
+void hmac_sha256_key_fini(struct hmac_sha256_key *key)
+{
+	assert(key);
+
+	memwipe(key, sizeof(*key));
+}
 
-	sha256_init(hc);
-	sha256_update(hc, blk, sizeof(blk));
+/* The ctx starts off as a key of its own. */
+void hmac_sha256_init(struct hmac_sha256_ctx *ctx, const void *key, int klen)
+{
+	assert(sizeof(*ctx) == sizeof(struct hmac_sha256_key));
+	hmac_sha256_key_init((struct hmac_sha256_key *)ctx, key, klen);
+}
+
+void hmac_sha256_init_from_key(struct hmac_sha256_ctx *ctx,
+			       const struct hmac_sha256_key *key)
+{
+	assert(ctx);
+	assert(key);
+	assert(sizeof(*ctx) == sizeof(*key));
+
+	memcpy(ctx, key, sizeof(*ctx));
 }
 
 void hmac_sha256_update(struct hmac_sha256_ctx *ctx, const void *bytes,
@@ -71,29 +100,21 @@ void hmac_sha256_update(struct hmac_sha256_ctx *ctx, const void *bytes,
 	struct hmac_sha256 *c = (struct hmac_sha256 *)ctx;
 
 	assert(c);
-	sha256_update(&c->sha256, bytes, len);
+	assert(len >= 0);
+	sha256_update(&c->inner, bytes, len);
 }
 
 void hmac_sha256_final(struct hmac_sha256_ctx *ctx, uint8_t *bytes)
 {
 	struct hmac_sha256 *c = (struct hmac_sha256 *)ctx;
-	int i;
-	struct sha256_ctx *hc;
 	uint8_t dgst[SHA256_DIGEST_LEN];
-	uint8_t blk[SHA256_BLOCK_LEN];
-
-	hc = &c->sha256;
-	sha256_final(hc, dgst);
 
-	memcpy(blk, c->k, SHA256_BLOCK_LEN);
-	for (i = 0; i < SHA256_BLOCK_LEN; ++i)
-		blk[i] ^= opad[i];
+	assert(c);
+	assert(bytes);
 
-	sha256_init(hc);
-	sha256_update(hc, blk, sizeof(blk));
-	sha256_update(hc, dgst, sizeof(dgst));
-	sha256_final(hc, bytes);
+	sha256_final(&c->inner, dgst);
+	sha256_update(&c->outer, dgst, sizeof(dgst));
+	sha256_final(&c->outer, bytes);
 
-	/* TODO secure. */
-	memset(c, -1, sizeof(*c));
+	memwipe(c, sizeof(*c));
 }
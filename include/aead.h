@@ -7,9 +7,48 @@
 #ifndef _AEAD_H_
 #define _AEAD_H_
 
-/* All nums at the interfaces, in little-endian byte-array form. */
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+struct aead_ctx {
+	uint64_t res[29];
+};
+
+/*
+ * All nums at the interfaces, in little-endian byte-array form. The
+ * decryptions return -1 if the tag does not match, with the plaintext they
+ * wrote zeroed.
+ */
 int	aead_enc(const uint8_t* key, const uint8_t *nonce, const void *msg,
 	int mlen,  const void *aad, int alen, uint8_t *out);
 int	aead_dec(const uint8_t* key, const uint8_t *nonce, const void *msg,
 	int mlen,  const void *aad, int alen, uint8_t *out);
+
+/*
+ * Scatter/gather. The msg is the concatenation of the in buffers, and the
+ * output is scattered over the out buffers; out may be in, provided both
+ * are laid out the same. aead_encv appends the tag to the output, and
+ * aead_decv expects it as the last 16 bytes of in. Both return the number
+ * of bytes written to out.
+ */
+int	aead_encv(const uint8_t *key, const uint8_t *nonce,
+	const struct iovec *aad, int naad, const struct iovec *in, int nin,
+	const struct iovec *out, int nout);
+int	aead_decv(const uint8_t *key, const uint8_t *nonce,
+	const struct iovec *aad, int naad, const struct iovec *in, int nin,
+	const struct iovec *out, int nout);
+
+/*
+ * Streaming: aead_init, any aead_update_aad calls, any aead_update calls,
+ * then aead_final (enc != 0) or aead_verify (enc == 0). When decrypting,
+ * aead_update releases the plaintext before the tag is checked; it must
+ * not be used until aead_verify returns 1.
+ */
+void	aead_init(struct aead_ctx *ctx, const uint8_t *key,
+	const uint8_t *nonce, int enc);
+void	aead_update_aad(struct aead_ctx *ctx, const void *aad, int alen);
+void	aead_update(struct aead_ctx *ctx, void *out, const void *in, int len);
+void	aead_final(struct aead_ctx *ctx, uint8_t *tag);
+int	aead_verify(struct aead_ctx *ctx, const uint8_t *tag);
 #endif
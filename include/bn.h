@@ -18,6 +18,29 @@ struct bn_ctx_mont;
 void		 bn_init();
 void		 bn_fini();
 
+/*
+ * The pool of the calling thread. Limbs come in BN_NUM_CLASSES size
+ * classes of 1, 2, 4, ... limbs. Each class grows by a slab whenever it
+ * runs dry.
+ */
+#define BN_NUM_CLASSES			12
+
+struct bn_stats {
+	int nlimbs[BN_NUM_CLASSES];	/* # of limbs per block. */
+	int ntotal[BN_NUM_CLASSES];	/* # of blocks held. */
+	int nfree[BN_NUM_CLASSES];
+	int npeak[BN_NUM_CLASSES];	/* Most blocks ever in use at once. */
+	int nnums_total;		/* The same, for the bns themselves. */
+	int nnums_free;
+	int nnums_peak;
+};
+
+void		 bn_stats(struct bn_stats *s);
+/* Free the wholly unused slabs, down to the high-water marks. */
+void		 bn_trim();
+/* Make room for n more numbers of up to nlimbs limbs, e.g. from a profile. */
+void		 bn_reserve(int nlimbs, int n);
+
 struct bn	*bn_new_zero();
 struct bn	*bn_new_from_int(int v);
 struct bn	*bn_new_from_bytes_be(const uint8_t *bytes, int len);
@@ -31,6 +54,11 @@ uint8_t		*bn_to_bytes_le(const struct bn *b, int *len);
 uint8_t		*bn_to_bytes_be(const struct bn *b, int *len);
 
 void		 bn_free(struct bn *b);
+/*
+ * The limbs of b are wiped whenever b lets go of them. Copies made with
+ * bn_new_copy inherit the mark.
+ */
+void		 bn_set_secret(struct bn *b);
 
 int		 bn_is_even(const struct bn *b);
 int		 bn_is_zero(const struct bn *b);
@@ -55,7 +83,7 @@ char		 bn_test_bit(const struct bn *a, int bit);
 char		 bn_mod_inv(struct bn *a, const struct bn *m);
 void		 bn_mod_pow(struct bn *a, const struct bn *e,
 		 const struct bn *m);
-void		 bn_mod_sqrt(struct bn *a, const struct bn *m);
+char		 bn_mod_sqrt(struct bn *a, const struct bn *m);
 
 
 
@@ -73,4 +101,5 @@ void		 bn_mul_mont(const struct bn_ctx_mont *ctx, struct bn *a,
 		 const struct bn *b);
 void		 bn_mod_pow_mont(const struct bn_ctx_mont *ctx, struct bn *a,
 		 const struct bn *e);
+void		 bn_mod_inv_mont(const struct bn_ctx_mont *ctx, struct bn *a);
 #endif
@@ -7,7 +7,9 @@
 #ifndef _BYTES_H_
 #define _BYTES_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #ifdef __OpenBSD__
 #include <endian.h>
@@ -43,6 +45,18 @@ static __inline__ uint32_t identity32(uint32_t x)
 	return x;
 }
 
+/*
+ * Zero n bytes at p, for secrets. The call goes through a volatile pointer,
+ * so that the compiler cannot drop it as a dead store, e.g. before a free
+ * or a return.
+ */
+static __inline__ void memwipe(void *p, size_t n)
+{
+	void *(*volatile f)(void *, int, size_t) = memset;
+
+	f(p, 0, n);
+}
+
 #ifdef __linux__
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 #define htobe16(x)			identity16(x)
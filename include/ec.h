@@ -79,8 +79,15 @@ void		 ece_point_free(const struct ec_edwards *ec,
 		 struct ec_point *a);
 void		 ece_point_normalize(const struct ec_edwards *ec,
 		 struct ec_point *a);
+void		 ece_point_normalize_batch(const struct ec_edwards *ec,
+		 struct ec_point *const *a, int n);
 void		 ece_scale(const struct ec_edwards *ec, struct ec_point **a,
 		 const struct bn *b);
+struct ec_point	*ece_scale_base(const struct ec_edwards *ec,
+		 const struct bn *b);
+struct ec_point	*ece_double_scale(const struct ec_edwards *ec,
+		 const struct bn *s1, const struct ec_point *p1,
+		 const struct bn *s2, const struct ec_point *p2);
 void		 ece_dbl(const struct ec_edwards *ec, struct ec_point *a);
 void		 ece_add(const struct ec_edwards *ec, struct ec_point *a,
 		 const struct ec_point *b);
@@ -102,6 +109,9 @@ struct edc	*edc_new_verify(const uint8_t *pub);
 void		 edc_free(struct edc *edc);
 void		 edc_sign(const struct edc *edc, uint8_t *tag,
 		 const uint8_t *msg, int mlen);
-void		 edc_verify(const struct edc *edc, const uint8_t *msg,
+int		 edc_verify(const struct edc *edc, const uint8_t *msg,
 		 int mlen);
+int		 edc_verify_batch(const struct edc *edc,
+		 const uint8_t *const *pubs, const uint8_t *const *msgs,
+		 const int *mlens, int n, int *res);
 #endif
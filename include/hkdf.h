@@ -9,10 +9,15 @@
 
 #include <stdint.h>
 
+#include <hmac.h>
+
 void	hkdf_sha256_extract(uint8_t *out, const void *salt, int slen,
 	const void *ikm, int klen);
 
 /* Returns in big-endian form; can be directly used to instantiate bn. */
 void	hkdf_sha256_expand(uint8_t *out, int olen, const void *prk, int plen,
 	const void *info, int ilen);
+/* As above, with the prk already set up as an HMAC key. */
+void	hkdf_sha256_expand_key(uint8_t *out, int olen,
+	const struct hmac_sha256_key *prk, const void *info, int ilen);
 #endif
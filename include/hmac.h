@@ -10,11 +10,26 @@
 #include <stdint.h>
 
 struct hmac_sha256_ctx {
-	uint8_t res[168];
+	uint64_t res[28];
 };
 
+/*
+ * A key with its inner and outer pad blocks already hashed. Set it up once
+ * to run any number of MACs under the same key, each of them two
+ * compressions cheaper than with hmac_sha256_init.
+ */
+struct hmac_sha256_key {
+	uint64_t res[28];
+};
+
+void	hmac_sha256_key_init(struct hmac_sha256_key *key, const void *bytes,
+	int klen);
+void	hmac_sha256_key_fini(struct hmac_sha256_key *key);
+
 void	hmac_sha256_init(struct hmac_sha256_ctx *ctx, const void *key,
 	int klen);
+void	hmac_sha256_init_from_key(struct hmac_sha256_ctx *ctx,
+	const struct hmac_sha256_key *key);
 void	hmac_sha256_update(struct hmac_sha256_ctx *ctx, const void *bytes,
 	int len);
 
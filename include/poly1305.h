@@ -10,8 +10,7 @@
 #include <stdint.h>
 
 struct poly1305_ctx {
-	void *res0[4];
-	uint8_t res1[20];
+	uint32_t res[19];
 };
 
 /* All nums at the interfaces, in little-endian byte-array form. */
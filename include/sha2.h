@@ -7,6 +7,7 @@
 #ifndef _SHA2_H_
 #define _SHA2_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define SHA256_BLOCK_LEN			64
@@ -15,20 +16,38 @@
 #define SHA512_DIGEST_LEN			64
 
 struct sha256_ctx {
-	uint8_t res[104];
+	uint64_t res[14];
 };
 
 struct sha512_ctx {
-	uint8_t res[200];
+	uint64_t res[26];
 };
 
 void	sha256_init(struct sha256_ctx *ctx);
-void	sha256_update(struct sha256_ctx *ctx, const void *bytes, int len);
+void	sha256_update(struct sha256_ctx *ctx, const void *bytes, size_t len);
 /* Returns in big-endian form. */
 void	sha256_final(struct sha256_ctx *ctx, uint8_t *bytes);
 
+/*
+ * Multi-buffer: n independent streams, ctx[i] fed with len[i] bytes at
+ * bytes[i]. The streams are stepped together, a block from each, so that
+ * up to SHA256_MB_LANES blocks are compressed at once on SIMD.
+ */
+#define SHA256_MB_LANES				8
+void	sha256_update_mb(struct sha256_ctx *const *ctx,
+	const void *const *bytes, const size_t *len, int n);
+void	sha256_final_mb(struct sha256_ctx *const *ctx, uint8_t *const *bytes,
+	int n);
+
 void	sha512_init(struct sha512_ctx *ctx);
-void	sha512_update(struct sha512_ctx *ctx, const void *bytes, int len);
+void	sha512_update(struct sha512_ctx *ctx, const void *bytes, size_t len);
 /* Returns in big-endian form. */
 void	sha512_final(struct sha512_ctx *ctx, uint8_t *bytes);
+
+/*
+ * The digest of the regular file at path, read through mmap. Returns 0, or
+ * -1 with errno set if the file cannot be opened or mapped.
+ */
+int	sha256_file(const char *path, uint8_t *bytes);
+int	sha512_file(const char *path, uint8_t *bytes);
 #endif
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef _SYS_AEAD_H_
+#define _SYS_AEAD_H_
+
+#include <chacha.h>
+#include <poly1305.h>
+#include <aead.h>
+
+struct aead {
+	struct chacha20_ctx chacha;	/* At blk 1 and up. */
+	struct poly1305_ctx poly;	/* Keyed by blk 0. */
+	uint64_t alen;
+	uint64_t mlen;
+	int enc;
+	int in_msg;	/* The aad has been padded; only msg from here. */
+};
+#endif
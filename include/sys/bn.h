@@ -7,24 +7,42 @@
 #ifndef _SYS_BN_H_
 #define _SYS_BN_H_
 
+#include <inttypes.h>
+#include <stdatomic.h>
+
 #include <bn.h>
 
 #include <sys/list.h>
 
+/* 64-bit limbs on x86-64, unless BN_LIMB32 is defined. */
+#if defined(__x86_64__) && !defined(BN_LIMB32)
+typedef uint64_t limb_t;
+__extension__ typedef unsigned __int128 limb2_t;
+__extension__ typedef __int128 slimb2_t;
+
+#define LIMB_BITS			64
+#define LIMB_BITS_LOG			6
+#define LIMB_FMT_STR			"%016" PRIx64
+#define LIMB_FMT_STR_MSL		"%" PRIx64
+#else
 typedef uint32_t limb_t;
 typedef uint64_t limb2_t;
 typedef int64_t slimb2_t;
 
 #define LIMB_BITS			32
 #define LIMB_BITS_LOG			5
+#define LIMB_FMT_STR			"%08" PRIx32
+#define LIMB_FMT_STR_MSL		"%" PRIx32
+#endif
+
 #define LIMB_BYTES			(LIMB_BITS >> 3)
 #define LIMB_BITS_MASK			(LIMB_BITS - 1)
 #define LIMB_BYTES_MASK			(LIMB_BYTES - 1)
 #define LIMB_BYTES_LOG			(LIMB_BITS_LOG - 3)
-#define LIMB_FMT_STR			"%08x"
 
 struct limbs {
 	struct list_head entry;
+	struct bn_slab *slab;	/* Invalid if caller-owned. */
 	int n;	/* # of limbs in the array. */
 	limb_t l[];
 };
@@ -38,47 +56,102 @@ limb_t	limb_cmp(const struct limbs *a, int na, const struct limbs *b, int nb);
 void	limb_shl(struct limbs *a, int na_prev, int na_curr, int c);
 void	limb_shr(struct limbs *a, int na_prev, int na_curr, int c);
 limb_t	limb_mul(struct limbs *a, int na, limb_t b);
+void	limb_neg(struct limbs *a, int na);
+void	limb_mul_mont(limb_t *t, const struct limbs *a, int na,
+		      const struct limbs *b, int nb, const struct limbs *m,
+		      int n, limb_t minv);
 
 #define BN_LIMBS_INVALID		(struct limbs *)NULL
 #define BN_POOL_INVALID			(struct bn_pool *)NULL
+#define BN_SLAB_INVALID			(struct bn_slab *)NULL
 
 struct bn {
 	struct list_head entry;
+	struct bn_slab *slab;	/* Invalid if caller-owned. */
 	struct limbs *l;
 	int nsig;	/* # of significant limbs.  */
 	int neg;
+	int fixed;	/* Caller-owned storage. See BN_DECLARE. */
+	int secret;	/* Wipe the limbs on release. See bn_set_secret. */
 };
 
+/*
+ * Declares struct bn *name, backed by nl limbs of automatic storage. Such
+ * a bn never grows; it must not be passed to bn_free.
+ *
+ * bn_add, bn_sub, bn_and, bn_shl, bn_shr, bn_copy and bn_set_bytes_le
+ * never touch the pool when their operands are caller-owned.
+ * The rest of the API accepts caller-owned bns too, but may still use the
+ * pool for its temporaries.
+ */
+#define BN_DECLARE(name, nl)						\
+	union {								\
+		struct limbs l;						\
+		uint8_t buf[sizeof(struct limbs) +			\
+			    ((nl) << LIMB_BYTES_LOG)];			\
+	} name##_storage;						\
+	struct bn name##_bn;						\
+	struct bn *name = bn_fixed_init(&name##_bn, &name##_storage.l, (nl))
+
+struct bn	*bn_fixed_init(struct bn *b, struct limbs *l, int nl);
+void		 bn_copy(struct bn *a, const struct bn *b);
+void		 bn_set_bytes_le(struct bn *a, const uint8_t *bytes, int len);
+
 #define NUM_FREE_BN				128
-#define NUM_LIMB_SIZES				12
+#define NUM_LIMB_SIZES				BN_NUM_CLASSES
 
+/*
+ * A run of n bns (cls < 0), or of n limbs of the size class cls, that was
+ * allocated in one go. The objects follow the header.
+ */
+struct bn_slab {
+	struct list_head entry;
+	struct bn_pool *pool;	/* Owner. */
+	int cls;
+	int n;
+	int nfree;
+};
+
+/*
+ * One per thread, attached by bn_init. The free lists belong to the owner
+ * thread alone. Other threads hand back what they free through the remote
+ * stacks, which are linked through entry.next and taken over by the owner
+ * whenever a free list runs dry. A class that is still dry then grows by
+ * a slab.
+ */
 struct bn_pool {
-	void *nums;
-	void *limbs;
+	struct list_head slabs;
 	int nfree_nums;
+	int ntotal_nums;
+	int npeak_nums;
 	struct list_head free_nums;
 	int nfree_limbs[NUM_LIMB_SIZES];
-	struct list_head free_limbs[NUM_LIMB_SIZES];
+	int ntotal_limbs[NUM_LIMB_SIZES];
 	int npeak_limbs[NUM_LIMB_SIZES];
+	struct list_head free_limbs[NUM_LIMB_SIZES];
+	_Atomic(struct list_head *) remote_nums;
+	_Atomic(struct list_head *) remote_limbs;
 };
 
 #define to_bn(e)		(list_entry(e, struct bn, entry))
 #define to_limbs(e)		(list_entry(e, struct limbs, entry))
+#define to_slab(e)		(list_entry(e, struct bn_slab, entry))
 
+/* The Reducer R is 2^(LIMB_BITS * m->nsig). */
 struct bn_ctx_mont {
-	int msb;		/* MSSB in m. */
 	struct bn *m;		/* Modulus. Odd and >= 3. */
-	struct bn *r;		/* Reducer. */
-	struct bn *rinv;	/* r' = Reducer's Inverse Mod m. */
-	struct bn *mask;	/* Modulo R operation (AND). */
-	struct bn *factor;	/* = (rr' - 1) / m. */
+	limb_t minv;		/* -m^-1 mod 2^LIMB_BITS. */
+	struct bn *rr;		/* R^2 mod m. */
 	struct bn *one;		/* 1 in Montgomery form for the given m. */
+	struct bn *pm2;		/* m - 2; the exponent of bn_mod_inv_mont. */
 };
 
 static __inline__ int bn_bsr(limb_t v)
 {
 	int msb;
-#ifdef __powerpc__
+#if LIMB_BITS == 64
+	msb = LIMB_BITS - 1 - __builtin_clzll(v);
+#elif defined(__powerpc__)
 	__asm__ volatile("cntlz %0, %1\t\n" : "=r" (msb) : "r" (v));
 	msb = LIMB_BITS - msb - 1;
 #else
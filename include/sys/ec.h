@@ -7,14 +7,71 @@
 #ifndef _SYS_EC_H_
 #define _SYS_EC_H_
 
+#include <stdatomic.h>
+
 #include <ec.h>
 
+#include <sys/fe25519.h>
+
 struct ec_point {
 	struct bn *x;
 	struct bn *y;
 	struct bn *z;
 };
 
+/*
+ * Curves over p = 2^255 - 19 run their formulas on the fixed-width
+ * elements of fe25519.c instead of on bn. The values here are regular
+ * numbers, i.e. not in the Montgomery form of mctx.
+ *
+ * On ec_edwards, the points are in the extended coordinates
+ * (X : Y : Z : T), with x = X / Z, y = Y / Z and T = X * Y / Z. ec_mont
+ * uses x and z only.
+ */
+struct ec_fe_point {
+	struct fe x;
+	struct fe y;
+	struct fe z;
+	struct fe t;
+};
+
+/* A point as the second operand of an addition: (Y + X, Y - X, Z, 2dT). */
+struct ec_fe_cached {
+	struct fe ypx;
+	struct fe ymx;
+	struct fe z;
+	struct fe t2d;
+};
+
+/* As ec_fe_cached, for an affine point: (y + x, y - x, 2dxy). */
+struct ec_fe_niels {
+	struct fe ypx;
+	struct fe ymx;
+	struct fe xy2d;
+};
+
+/*
+ * The comb for [s]G on ec_edwards: base[8 * i + j] = (j + 1) * 16^(2i) * G,
+ * for i in [0, 32) and j in [0, 8).
+ */
+#define EC_FE_BASE_NROWS		32
+#define EC_FE_BASE_NCOLS		8
+
+/* The sliding windows of ece_double_scale use the odd multiples 1..15. */
+#define EC_FE_SLIDE_NPTS		8
+
+struct ec_fe {
+	struct fe r;		/* R mod p, R being the reducer of mctx. */
+	struct fe rinv;		/* R^-1 mod p. */
+	struct fe a;
+	struct fe cnst;		/* ec_mont only. */
+	struct fe d;		/* ec_edwards only. */
+	struct fe d2;		/* 2d; ec_edwards only. */
+	/* ec_edwards only; built on the first [b]G. See ece_fe_base. */
+	_Atomic(struct ec_fe_niels *) base;
+	struct ec_fe_niels base_odd[EC_FE_SLIDE_NPTS];	/* (2j + 1) * G */
+};
+
 struct ec_mont {
 	struct bn *prime;
 	struct bn *a;
@@ -23,6 +80,7 @@ struct ec_mont {
 	struct bn *cnst;	/* (a + 2) / 4 */
 	struct ec_point gen;
 	struct bn_ctx_mont *mctx;
+	struct ec_fe *fe;	/* NULL, unless the prime is 2^255 - 19. */
 };
 
 struct ec_edwards {
@@ -32,6 +90,8 @@ struct ec_edwards {
 	struct bn *order;
 	struct ec_point gen;
 	struct bn_ctx_mont *mctx;
+	/* NULL, unless the prime is 2^255 - 19 and a is -1. */
+	struct ec_fe *fe;
 };
 
 struct edc {
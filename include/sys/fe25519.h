@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef _SYS_FE25519_H_
+#define _SYS_FE25519_H_
+
+#include <stdint.h>
+
+#include <bn.h>
+
+/*
+ * An element of GF(2^255 - 19) in radix 2^25.5: v[i] is the coefficient of
+ * 2^ceil(25.5 * i), i.e. the limbs alternate between 26 and 25 bits. The
+ * limbs are signed, and are allowed to grow past their width between
+ * reductions (lazy carry).
+ *
+ * The output of fe_mul, fe_sq and fe_invert is reduced (|v[i]| <= ~2^25).
+ * The inputs to fe_mul and fe_sq may be the results of at most two levels
+ * of fe_add/fe_sub/fe_neg applied to reduced elements.
+ */
+struct fe {
+	int32_t v[10];
+};
+
+void	fe_zero(struct fe *h);
+void	fe_one(struct fe *h);
+void	fe_add(struct fe *h, const struct fe *f, const struct fe *g);
+void	fe_sub(struct fe *h, const struct fe *f, const struct fe *g);
+void	fe_neg(struct fe *h, const struct fe *f);
+void	fe_mul(struct fe *h, const struct fe *f, const struct fe *g);
+void	fe_sq(struct fe *h, const struct fe *f);
+void	fe_invert(struct fe *h, const struct fe *z);
+void	fe_cmov(struct fe *h, const struct fe *g, int b);
+void	fe_cswap(struct fe *f, struct fe *g, int b);
+
+/* Little-endian, 32 bytes. The top bit of s is ignored. */
+void	fe_from_bytes(struct fe *h, const uint8_t *s);
+/* Little-endian, 32 bytes, fully reduced mod p. */
+void	fe_to_bytes(uint8_t *s, const struct fe *h);
+
+/* b must be a regular, non-negative number < 2^255. */
+void	fe_from_bn(struct fe *h, const struct bn *b);
+struct bn
+	*fe_to_bn(const struct fe *h);
+#endif
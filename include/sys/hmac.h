@@ -10,8 +10,13 @@
 #include <sha2.h>
 #include <hmac.h>
 
+/*
+ * Both the ctx and the key. In a key, inner and outer hold the states
+ * right after the K ^ ipad and the K ^ opad blocks; in a ctx, inner goes
+ * on to take the message.
+ */
 struct hmac_sha256 {
-	struct sha256_ctx sha256;	/* B=64, L=32 */
-	uint8_t k[SHA256_BLOCK_LEN];
+	struct sha256_ctx inner;	/* B=64, L=32 */
+	struct sha256_ctx outer;
 };
 #endif
@@ -7,14 +7,16 @@
 #ifndef _SYS_POLY1305_H_
 #define _SYS_POLY1305_H_
 
-#include <bn.h>
 #include <poly1305.h>
 
+/*
+ * h and r are held in radix 2^26, as 5 limbs each. s is the pad, as 4
+ * little-endian words.
+ */
 struct poly1305 {
-	struct bn *prime;
-	struct bn *acc;
-	struct bn *r;
-	struct bn *s;
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t s[4];
 	uint8_t buf[16];
 	int ix;
 };
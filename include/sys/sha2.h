@@ -9,21 +9,26 @@
 
 #include <sha2.h>
 
+/* SHA-256 takes messages of < 2^64 bits, i.e. of < 2^55 512-bit words. */
+#define SHA256_MAX_NWORDS			((uint64_t)1 << 55)
+
 struct sha256 {
 	uint32_t h[8];
-	/* XXX nwords restricts the total size of data that can be hashed. */
-	uint32_t nwords;	/* # of 512-bit words. */
+	uint64_t nwords;	/* # of 512-bit words. */
 	uint8_t buf[SHA256_BLOCK_LEN];	/* Accumulator */
 	uint8_t nbytes;		/* # of bytes in the accumulator. */
-	uint8_t res[3];
+	uint8_t res[7];
 };
 
+/*
+ * The 128-bit length in bits is nwords:nbytes, i.e. nwords * 2^10 +
+ * nbytes * 8; 2^64 words cover any message that can be handed in.
+ */
 struct sha512 {
 	uint64_t h[8];
-	/* XXX nwords restricts the total size of data that can be hashed. */
-	uint32_t nwords;	/* # of 1024-bit words. */
+	uint64_t nwords;	/* # of 1024-bit words. */
 	uint8_t buf[SHA512_BLOCK_LEN];	/* Accumulator */
 	uint8_t nbytes;		/* # of bytes in the accumulator. */
-	uint8_t res[3];
+	uint8_t res[7];
 };
 #endif
@@ -121,6 +121,98 @@ limb_t limb_mul(struct limbs *a, int na, limb_t b)
 	return r;
 }
 
+/* Two's complement of the na limbs. */
+void limb_neg(struct limbs *a, int na)
+{
+	int i;
+	limb2_t r;
+
+	assert(na >= 0);
+
+	r = 1;
+	for (i = 0; i < na; ++i) {
+		r += (limb_t)~a->l[i];
+		a->l[i] = r;
+		r >>= LIMB_BITS;
+	}
+}
+
+/*
+ * Montgomery multiplication, CIOS (Koc, Acar, Kaliski):
+ * t = a * b * 2^-(LIMB_BITS * n) mod m.
+ *
+ * m is of n limbs, and minv = -m^-1 mod 2^LIMB_BITS. a and b are < m, of
+ * na and nb limbs. t must have room for n + 2 limbs; the result, fully
+ * reduced, is in its low n limbs.
+ */
+void limb_mul_mont(limb_t *t, const struct limbs *a, int na,
+		   const struct limbs *b, int nb, const struct limbs *m,
+		   int n, limb_t minv)
+{
+	int i, j, ge;
+	limb_t q;
+	limb2_t r;
+
+	assert(n > 0 && na <= n && nb <= n);
+
+	memset(t, 0, (n + 2) << LIMB_BYTES_LOG);
+	for (i = 0; i < n; ++i) {
+		/* t += a * b[i]. */
+		if (i < nb) {
+			r = 0;
+			for (j = 0; j < na; ++j) {
+				r += (limb2_t)a->l[j] * b->l[i];
+				r += t[j];
+				t[j] = r;
+				r >>= LIMB_BITS;
+			}
+			for (; j <= n; ++j) {
+				r += t[j];
+				t[j] = r;
+				r >>= LIMB_BITS;
+			}
+			t[n + 1] = r;
+		}
+
+		/* t = (t + q * m) / 2^LIMB_BITS; q clears the low limb. */
+		q = t[0] * minv;
+		r = (limb2_t)q * m->l[0] + t[0];
+		r >>= LIMB_BITS;
+		for (j = 1; j < n; ++j) {
+			r += (limb2_t)q * m->l[j];
+			r += t[j];
+			t[j - 1] = r;
+			r >>= LIMB_BITS;
+		}
+		r += t[n];
+		t[n - 1] = r;
+		r >>= LIMB_BITS;
+		t[n] = t[n + 1] + r;
+		t[n + 1] = 0;
+	}
+
+	/* t < 2m. */
+	ge = 1;
+	if (t[n] == 0) {
+		for (j = n - 1; j >= 0; --j) {
+			if (t[j] != m->l[j]) {
+				ge = t[j] > m->l[j];
+				break;
+			}
+		}
+	}
+	if (!ge)
+		return;
+
+	r = 0;
+	for (j = 0; j < n; ++j) {
+		r = (limb2_t)t[j] - m->l[j] - r;
+		t[j] = r;
+		r = (r >> LIMB_BITS) & 1;
+	}
+	t[n] = 0;
+}
+
 /* The function assumes space available. */
 void limb_shl(struct limbs *a, int na_prev, int na_curr, int c)
 {
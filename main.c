@@ -66,14 +66,15 @@ const uint8_t pub[] = {
 };
 int main()
 {
+	int ok;
 	struct edc *edc;
 
 	bn_init();
 	edc = edc_new_verify(pub);
-	edc_verify(edc, tag, 64);
+	ok = edc_verify(edc, tag, 64);
 	edc_free(edc);
 	bn_fini();
-	return 0;
+	return !ok;
 }
 
 #if 0
@@ -11,11 +11,30 @@
 
 /* Coforms to RFC 7539. */
 
-static const char *prime_str = "3fffffffffffffffffffffffffffffffb";
+#define POLY1305_MASK26			0x3ffffff
+
+static uint32_t poly1305_load32(const uint8_t *s)
+{
+	uint32_t v;
+
+	v  = (uint32_t)s[0];
+	v |= (uint32_t)s[1] << 8;
+	v |= (uint32_t)s[2] << 16;
+	v |= (uint32_t)s[3] << 24;
+	return v;
+}
+
+static void poly1305_store32(uint8_t *s, uint32_t v)
+{
+	s[0] = v;
+	s[1] = v >> 8;
+	s[2] = v >> 16;
+	s[3] = v >> 24;
+}
+
 void poly1305_init(struct poly1305_ctx *ctx, const uint8_t *key)
 {
-	uint8_t r[16];
-	uint8_t s[16];
+	int i;
 	struct poly1305 *c;
 
 	assert(ctx);
@@ -24,40 +43,102 @@ void poly1305_init(struct poly1305_ctx *ctx, const uint8_t *key)
 	assert(sizeof(*c) == sizeof(*ctx));
 	c = (struct poly1305 *)ctx;
 
-	memcpy(r, key, 16);
-	memcpy(s, key + 16, 16);
-
-	r[3] &= 0xf;
-	r[7] &= 0xf;
-	r[11] &= 0xf;
-	r[15] &= 0xf;
+	/*
+	 * r &= 0x0ffffffc0ffffffc0ffffffc0fffffff, split into 26-bit limbs
+	 * starting at the bytes 0, 3, 6, 9 and 12.
+	 */
+	c->r[0] = (poly1305_load32(key +  0) >> 0) & 0x3ffffff;
+	c->r[1] = (poly1305_load32(key +  3) >> 2) & 0x3ffff03;
+	c->r[2] = (poly1305_load32(key +  6) >> 4) & 0x3ffc0ff;
+	c->r[3] = (poly1305_load32(key +  9) >> 6) & 0x3f03fff;
+	c->r[4] = (poly1305_load32(key + 12) >> 8) & 0x00fffff;
 
-	r[4] &= 0xfc;
-	r[8] &= 0xfc;
-	r[12] &= 0xfc;
+	for (i = 0; i < 4; ++i)
+		c->s[i] = poly1305_load32(key + 16 + 4 * i);
 
-	c->prime = bn_new_from_string_be(prime_str, 16);
-	c->r = bn_new_from_bytes_le(r, 16);
-	c->s = bn_new_from_bytes_le(s, 16);
-	c->acc = bn_new_zero();
+	memset(c->h, 0, sizeof(c->h));
 	c->ix = 0;
 }
 
-static void poly1305_block(struct poly1305 *c, int len)
+/*
+ * h = (h + m) * r mod p, for each of the n 16-byte blocks in m. hibit is
+ * the 2^128 bit appended to each block, as seen from limb 4. The products
+ * that land at or beyond 2^130 are folded back with a * 5, since 2^130 ==
+ * 5 mod p; h is kept partially reduced (limbs of at most 26 bits + a bit).
+ */
+static void poly1305_blocks(struct poly1305 *c, const uint8_t *m, int n,
+			    uint32_t hibit)
 {
-	struct bn *t;
-
-	t = bn_new_from_bytes_le(c->buf, len);
-	bn_add(c->acc, t);
-	bn_free(t);
-
-	t = bn_new_from_int(1);
-	bn_shl(t, len << 3);
-	bn_add(c->acc, t);
-	bn_free(t);
+	uint32_t r0, r1, r2, r3, r4, s1, s2, s3, s4;
+	uint32_t h0, h1, h2, h3, h4;
+	uint64_t d0, d1, d2, d3, d4;
+	uint32_t cr;
+
+	r0 = c->r[0];
+	r1 = c->r[1];
+	r2 = c->r[2];
+	r3 = c->r[3];
+	r4 = c->r[4];
+
+	s1 = r1 * 5;
+	s2 = r2 * 5;
+	s3 = r3 * 5;
+	s4 = r4 * 5;
+
+	h0 = c->h[0];
+	h1 = c->h[1];
+	h2 = c->h[2];
+	h3 = c->h[3];
+	h4 = c->h[4];
+
+	for (; n; --n, m += 16) {
+		h0 += (poly1305_load32(m +  0) >> 0) & POLY1305_MASK26;
+		h1 += (poly1305_load32(m +  3) >> 2) & POLY1305_MASK26;
+		h2 += (poly1305_load32(m +  6) >> 4) & POLY1305_MASK26;
+		h3 += (poly1305_load32(m +  9) >> 6) & POLY1305_MASK26;
+		h4 += (poly1305_load32(m + 12) >> 8) | hibit;
+
+		d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 +
+		     (uint64_t)h2 * s3 + (uint64_t)h3 * s2 +
+		     (uint64_t)h4 * s1;
+		d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 +
+		     (uint64_t)h2 * s4 + (uint64_t)h3 * s3 +
+		     (uint64_t)h4 * s2;
+		d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 +
+		     (uint64_t)h2 * r0 + (uint64_t)h3 * s4 +
+		     (uint64_t)h4 * s3;
+		d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 +
+		     (uint64_t)h2 * r1 + (uint64_t)h3 * r0 +
+		     (uint64_t)h4 * s4;
+		d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 +
+		     (uint64_t)h2 * r2 + (uint64_t)h3 * r1 +
+		     (uint64_t)h4 * r0;
+
+		cr = d0 >> 26;
+		h0 = d0 & POLY1305_MASK26;
+		d1 += cr;
+		cr = d1 >> 26;
+		h1 = d1 & POLY1305_MASK26;
+		d2 += cr;
+		cr = d2 >> 26;
+		h2 = d2 & POLY1305_MASK26;
+		d3 += cr;
+		cr = d3 >> 26;
+		h3 = d3 & POLY1305_MASK26;
+		d4 += cr;
+		cr = d4 >> 26;
+		h4 = d4 & POLY1305_MASK26;
+		h0 += cr * 5;
+		cr = h0 >> 26;
+		h0 &= POLY1305_MASK26;
+		h1 += cr;
+	}
 
-	bn_mul(c->acc, c->r);
-	bn_mod(c->acc, c->prime);
+	c->h[0] = h0;
+	c->h[1] = h1;
+	c->h[2] = h2;
+	c->h[3] = h3;
+	c->h[4] = h4;
 }
 
 void poly1305_update(struct poly1305_ctx *ctx, const void *msg, int mlen)
@@ -72,7 +153,7 @@ void poly1305_update(struct poly1305_ctx *ctx, const void *msg, int mlen)
 	c = (struct poly1305 *)ctx;
 
 	m = msg;
-	for (;mlen;) {
+	if (c->ix) {
 		left = 16 - c->ix;
 		n = left < mlen ? left : mlen;
 		memcpy(&c->buf[c->ix], m, n);
@@ -80,36 +161,75 @@ void poly1305_update(struct poly1305_ctx *ctx, const void *msg, int mlen)
 		m += n;
 		mlen -= n;
 
-		if (c->ix == 16) {
-			poly1305_block(c, c->ix);
-			c->ix = 0;
-		}
+		if (c->ix < 16)
+			return;
+		poly1305_blocks(c, c->buf, 1, 1 << 24);
+		c->ix = 0;
 	}
+
+	/* The full blocks straight from msg. */
+	n = mlen >> 4;
+	if (n) {
+		poly1305_blocks(c, m, n, 1 << 24);
+		m += n << 4;
+		mlen -= n << 4;
+	}
+
+	memcpy(c->buf, m, mlen);
+	c->ix = mlen;
 }
 
 void poly1305_final(struct poly1305_ctx *ctx, uint8_t *out)
 {
-	int n;
-	uint8_t *o;
+	int i;
+	uint32_t h[5], g[5], cr, mask;
+	uint64_t f;
 	struct poly1305 *c;
 
 	assert(ctx);
 	assert(out);
 	c = (struct poly1305 *)ctx;
 
-	if (c->ix)
-		poly1305_block(c, c->ix);
-
-	bn_add(c->acc, c->s);
-	o = bn_to_bytes_le(c->acc, &n);
+	/* The last partial block has its 0x01 byte in place of the 2^128. */
+	if (c->ix) {
+		c->buf[c->ix] = 1;
+		memset(&c->buf[c->ix + 1], 0, 16 - c->ix - 1);
+		poly1305_blocks(c, c->buf, 1, 0);
+	}
 
-	bn_free(c->acc);
-	bn_free(c->r);
-	bn_free(c->s);
-	bn_free(c->prime);
+	/* Fully carry h. */
+	memcpy(h, c->h, sizeof(h));
+	for (i = 1, cr = 0; i < 5; ++i) {
+		h[i] += cr;
+		cr = h[i] >> 26;
+		h[i] &= POLY1305_MASK26;
+	}
+	h[0] += cr * 5;
+	cr = h[0] >> 26;
+	h[0] &= POLY1305_MASK26;
+	h[1] += cr;
+
+	/* g = h + 5 - 2^130; h = g if g >= 0, i.e. h >= p. Without branches. */
+	for (i = 0, cr = 5; i < 5; ++i) {
+		g[i] = h[i] + cr;
+		cr = g[i] >> 26;
+		g[i] &= POLY1305_MASK26;
+	}
+	mask = -cr;
+	for (i = 0; i < 5; ++i)
+		h[i] = (h[i] & ~mask) | (g[i] & mask);
+
+	/* To 4 words, and add s mod 2^128. */
+	h[0] = h[0] | (h[1] << 26);
+	h[1] = (h[1] >> 6) | (h[2] << 20);
+	h[2] = (h[2] >> 12) | (h[3] << 14);
+	h[3] = (h[3] >> 18) | (h[4] << 8);
+
+	for (i = 0, f = 0; i < 4; ++i) {
+		f += (uint64_t)h[i] + c->s[i];
+		poly1305_store32(out + 4 * i, f);
+		f >>= 32;
+	}
 
-	n = n < 16 ? n : 16;
-	memcpy(out, o, n);
-	if (n < 16)
-		memset(out + n, 0, 16 - n);
+	memset(c, 0, sizeof(*c));
 }
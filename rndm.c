@@ -4,6 +4,9 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+/* For rand_r. */
+#define _POSIX_C_SOURCE			200112L
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,6 +20,7 @@
 void rndm_fill(void *bytes, int nbits)
 {
 	int len, i;
+	unsigned int seed;
 	uint8_t *p;
 	struct timeval tv;
 
@@ -30,12 +34,12 @@ void rndm_fill(void *bytes, int nbits)
 	p = bytes;
 	memset(p, 0, len);
 
-	/* Not cryptographically secure. */
+	/* Not cryptographically secure. The seed is per call, not global. */
 	gettimeofday(&tv, NULL);
-	srand(tv.tv_usec);
+	seed = tv.tv_usec;
 
 	for (i = len - 1; i >= 0; --i)
-		p[i] = rand() & 0xff;
+		p[i] = rand_r(&seed) & 0xff;
 
 	/* Zero extranous bits in the msb. */
 	if (nbits)
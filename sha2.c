@@ -4,11 +4,25 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+/* For posix_madvise. */
+#define _POSIX_C_SOURCE			200112L
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA2_SIMD
+#endif
 
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <bytes.h>
 
@@ -83,136 +97,250 @@ static uint32_t ror32(uint32_t v, int c)
 	return (v >> c) | (v << (32 - c));
 }
 
-static void sha256_block(struct sha256 *c)
+static uint32_t sha256_load32(const uint8_t *m)
+{
+	uint32_t v;
+
+	memcpy(&v, m, sizeof(v));
+	return be32toh(v);
+}
+
+/*
+ * Compress the n 64-byte blocks at p into h. The chaining values stay in
+ * locals across the blocks.
+ */
+static void sha256_blocks_generic(uint32_t *h, const uint8_t *p, size_t n)
 {
 	int i;
 	uint32_t s0, s1, ch, t0, t1;
-	uint32_t lh[8];
-	static uint32_t w[64];
+	uint32_t lh[8], hh[8];
+	uint32_t w[64];
+
+	memcpy(hh, h, sizeof(hh));
+	for (; n; --n, p += SHA256_BLOCK_LEN) {
+		for (i = 0; i < SHA256_BLOCK_LEN; i += sizeof(uint32_t))
+			w[i >> 2] = sha256_load32(p + i);
+
+		for (i = 16; i < 64; ++i) {
+			s0 = 0;
+			s0 ^= ror32(w[i - 15], 7);
+			s0 ^= ror32(w[i - 15], 18);
+			s0 ^= w[i - 15] >> 3;
+
+			s1 = 0;
+			s1 ^= ror32(w[i - 2], 17);
+			s1 ^= ror32(w[i - 2], 19);
+			s1 ^= w[i - 2] >> 10;
+
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		memcpy(lh, hh, sizeof(hh));
+		for (i = 0; i < 64; ++i) {
+			s1 = 0;
+			s1 ^= ror32(lh[4], 6);
+			s1 ^= ror32(lh[4], 11);
+			s1 ^= ror32(lh[4], 25);
+
+			ch = 0;
+			ch ^= lh[4] & lh[5];
+			ch ^= (~lh[4]) & lh[6];
+			t0 = lh[7] + s1 + ch + sha256_rk[i] + w[i];
+
+			s0 = 0;
+			s0 ^= ror32(lh[0], 2);
+			s0 ^= ror32(lh[0], 13);
+			s0 ^= ror32(lh[0], 22);
+
+			ch = 0;
+			ch ^= lh[0] & lh[1];
+			ch ^= lh[0] & lh[2];
+			ch ^= lh[1] & lh[2];
+			t1 = s0 + ch;
+
+			lh[7] = lh[6];
+			lh[6] = lh[5];
+			lh[5] = lh[4];
+			lh[4] = lh[3] + t0;
+			lh[3] = lh[2];
+			lh[2] = lh[1];
+			lh[1] = lh[0];
+			lh[0] = t0 + t1;
+		}
 
-	for (i = 0; i < SHA256_BLOCK_LEN; i += sizeof(uint32_t))
-		w[i >> 2] = htonl(*(uint32_t *)(c->buf + i));
+		for (i = 0; i < 8; ++i)
+			hh[i] += lh[i];
+	}
+	memcpy(h, hh, sizeof(hh));
 
-	for (i = 16; i < 64; ++i) {
-		s0 = 0;
-		s0 ^= ror32(w[i - 15], 7);
-		s0 ^= ror32(w[i - 15], 18);
-		s0 ^= w[i - 15] >> 3;
+	/* TODO secure. */
+	memset(w, -1, sizeof(w));
+}
 
-		s1 = 0;
-		s1 ^= ror32(w[i - 2], 17);
-		s1 ^= ror32(w[i - 2], 19);
-		s1 ^= w[i - 2] >> 10;
+#ifdef SHA2_SIMD
+/*
+ * With the SHA extensions. The state is kept as ABEF and CDGH, the layout
+ * SHA256RNDS2 expects; each SHA256RNDS2 does two rounds, and the schedule
+ * is kept as 4 vectors of 4 words each, w[4 * i .. 4 * i + 3] in m[i % 4].
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t *h, const uint8_t *p, size_t n)
+{
+	int i;
+	__m128i abef, cdgh, abef0, cdgh0, m[4], k, t, mask;
+
+	mask = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+	t    = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&h[0]), 0xb1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&h[4]), 0x1b);
+	abef = _mm_alignr_epi8(t, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+
+	for (; n; --n, p += SHA256_BLOCK_LEN) {
+		abef0 = abef;
+		cdgh0 = cdgh;
+
+		for (i = 0; i < 4; ++i)
+			m[i] = _mm_loadu_si128((__m128i *)(p + 16 * i));
+		for (i = 0; i < 4; ++i)
+			m[i] = _mm_shuffle_epi8(m[i], mask);
+
+		for (i = 0; i < 16; ++i) {
+			k = _mm_loadu_si128((__m128i *)&sha256_rk[4 * i]);
+			k = _mm_add_epi32(m[i & 3], k);
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, k);
+
+			/* w[4 * (i + 1) ..] for the rounds 16 and above. */
+			if (i >= 3 && i < 15) {
+				t = _mm_alignr_epi8(m[i & 3], m[(i - 1) & 3], 4);
+				t = _mm_add_epi32(m[(i + 1) & 3], t);
+				m[(i + 1) & 3] = _mm_sha256msg2_epu32(t,
+								      m[i & 3]);
+			}
+
+			k = _mm_shuffle_epi32(k, 0x0e);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh, k);
+
+			if (i >= 1 && i < 13) {
+				t = m[(i - 1) & 3];
+				m[(i - 1) & 3] = _mm_sha256msg1_epu32(t,
+								      m[i & 3]);
+			}
+		}
 
-		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
-	}
-	memcpy(lh, c->h, sizeof(c->h));
-	for (i = 0; i < 64; ++i) {
-		s1 = 0;
-		s1 ^= ror32(lh[4], 6);
-		s1 ^= ror32(lh[4], 11);
-		s1 ^= ror32(lh[4], 25);
-
-		ch = 0;
-		ch ^= lh[4] & lh[5];
-		ch ^= (~lh[4]) & lh[6];
-		t0 = lh[7] + s1 + ch + sha256_rk[i] + w[i];
-
-		s0 = 0;
-		s0 ^= ror32(lh[0], 2);
-		s0 ^= ror32(lh[0], 13);
-		s0 ^= ror32(lh[0], 22);
-
-		ch = 0;
-		ch ^= lh[0] & lh[1];
-		ch ^= lh[0] & lh[2];
-		ch ^= lh[1] & lh[2];
-		t1 = s0 + ch;
-
-		lh[7] = lh[6];
-		lh[6] = lh[5];
-		lh[5] = lh[4];
-		lh[4] = lh[3] + t0;
-		lh[3] = lh[2];
-		lh[2] = lh[1];
-		lh[1] = lh[0];
-		lh[0] = t0 + t1;
+		abef = _mm_add_epi32(abef, abef0);
+		cdgh = _mm_add_epi32(cdgh, cdgh0);
 	}
 
-	for (i = 0; i < 8; ++i)
-		c->h[i] += lh[i];
+	t    = _mm_shuffle_epi32(abef, 0x1b);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+	_mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(t, cdgh, 0xf0));
+	_mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(cdgh, t, 8));
+}
+#endif
+
+static void (*sha256_blocks)(uint32_t *h, const uint8_t *p, size_t n) =
+	sha256_blocks_generic;
 
-	/* TODO secure. */
-	memset(w, -1, sizeof(w));
+#ifdef SHA2_SIMD
+/* The SHA extensions have no __builtin_cpu_supports name here; ask CPUID. */
+static int sha2_cpu_has_shani(void)
+{
+	unsigned int a, b, c, d;
+
+	if (!__get_cpuid(1, &a, &b, &c, &d))
+		return 0;
+	if (!(c & bit_SSSE3) || !(c & bit_SSE4_1))
+		return 0;
+	if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		return 0;
+	return (b & bit_SHA) != 0;
+}
+
+/* Pick the compression function once, before main. */
+__attribute__((constructor))
+static void sha2_dispatch(void)
+{
+	if (sha2_cpu_has_shani())
+		sha256_blocks = sha256_blocks_shani;
+}
+#endif
+
+static void sha256_count(struct sha256 *c, size_t n)
+{
+	c->nwords += n;
+	/* Overflow. */
+	assert(c->nwords < SHA256_MAX_NWORDS);
 }
 
-void sha256_update(struct sha256_ctx *ctx, const void *bytes, int len)
+void sha256_update(struct sha256_ctx *ctx, const void *bytes, size_t len)
 {
 	struct sha256 *c = (struct sha256 *)ctx;
-	int diff, n, src;
-	const char *in;
+	size_t diff, n;
+	const uint8_t *in;
 
 	assert(c != NULL);
-	assert(len >= 0);
 	if (len == 0)
 		return;
 	assert(bytes);
 
 	in = bytes;
-	src = 0;
-	for (; len;) {
+	if (c->nbytes) {
 		diff = SHA256_BLOCK_LEN - c->nbytes;
 		n = diff < len ? diff : len;
-		memcpy(c->buf + c->nbytes, in + src, n);
+		memcpy(c->buf + c->nbytes, in, n);
 		c->nbytes += n;
-		src += n;
+		in += n;
 		len -= n;
 
-		if (c->nbytes == SHA256_BLOCK_LEN) {
-			c->nbytes = 0;
-			++c->nwords;
-			/* Overflow. */
-			assert(c->nwords != 0);
-			sha256_block(c);
-		}
+		if (c->nbytes < SHA256_BLOCK_LEN)
+			return;
+		c->nbytes = 0;
+		sha256_count(c, 1);
+		sha256_blocks(c->h, c->buf, 1);
 	}
+
+	/* The whole blocks straight from bytes; the accumulator gets the rest. */
+	n = len / SHA256_BLOCK_LEN;
+	if (n) {
+		sha256_count(c, n);
+		sha256_blocks(c->h, in, n);
+		in += n * SHA256_BLOCK_LEN;
+		len -= n * SHA256_BLOCK_LEN;
+	}
+
+	memcpy(c->buf, in, len);
+	c->nbytes = len;
 }
 
-void sha256_final(struct sha256_ctx *ctx, uint8_t *bytes)
+/*
+ * The padding of the message so far: 0x80, the zeroes, and the length in
+ * bits as a 64-bit big-endian number, up to the end of a block. Returns
+ * its length, which is 9 to 72 bytes. For the multi-buffer final, which
+ * feeds it through the lanes.
+ */
+static int sha256_pad(const struct sha256 *c, uint8_t *pad)
 {
-	struct sha256 *c = (struct sha256 *)ctx;
-	int i, j;
-	uint8_t byte;
-	uint64_t nbits, k, mask, len;
-
-	assert(c != NULL);
-	assert(bytes);
+	int n;
+	uint64_t nbits;
 
 	nbits   = c->nwords;
 	nbits <<= 9;
 	nbits  += c->nbytes << 3;
-	len = htobe64(nbits);
-	nbits += 1;	/* Append a single bit 1. */
-	nbits += 64;	/* 64 == size of the size of the message. */
-
-	mask = ((uint64_t)1 << 9) - 1;
-	k = nbits & mask;
-	assert(k);
-	k = 512 - k;	/* # of zeroes to append. */
-
-	byte = 0x80;
-	if (k) {
-		assert(k >= 7);
-		sha256_update(ctx, &byte, 1);
-		k -= 7;
-	}
+	nbits = htobe64(nbits);
+
+	n = SHA256_BLOCK_LEN - c->nbytes;
+	if (n < 1 + 8)
+		n += SHA256_BLOCK_LEN;
+	memset(pad, 0, n);
+	pad[0] = 0x80;
+	memcpy(pad + n - 8, &nbits, 8);
+	return n;
+}
+
+static void sha256_digest(const struct sha256 *c, uint8_t *bytes)
+{
+	int i, j;
 
-	byte = 0;
-	while (k) {
-		sha256_update(ctx, &byte, 1);
-		k -= 8;
-	}
-	sha256_update(ctx, &len, sizeof(len));
 	for (i = 0; i < SHA256_DIGEST_LEN; i += 4) {
 		j = i >> 2;
 		bytes[i + 0] = (c->h[j] >> 24) & 0xff;
@@ -220,16 +348,325 @@ void sha256_final(struct sha256_ctx *ctx, uint8_t *bytes)
 		bytes[i + 2] = (c->h[j] >> 8) & 0xff;
 		bytes[i + 3] = (c->h[j] >> 0) & 0xff;
 	}
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t *bytes)
+{
+	struct sha256 *c = (struct sha256 *)ctx;
+	uint64_t nbits;
+
+	assert(c != NULL);
+	assert(bytes);
+
+	nbits   = c->nwords;
+	nbits <<= 9;
+	nbits  += c->nbytes << 3;
+	nbits = htobe64(nbits);
+
+	/*
+	 * Pad in place. If the length does not fit after the 0x80, the
+	 * padding spills into a second block.
+	 */
+	c->buf[c->nbytes++] = 0x80;
+	if (c->nbytes > SHA256_BLOCK_LEN - 8) {
+		memset(c->buf + c->nbytes, 0, SHA256_BLOCK_LEN - c->nbytes);
+		sha256_blocks(c->h, c->buf, 1);
+		c->nbytes = 0;
+	}
+	memset(c->buf + c->nbytes, 0, SHA256_BLOCK_LEN - 8 - c->nbytes);
+	memcpy(c->buf + SHA256_BLOCK_LEN - 8, &nbits, 8);
+	sha256_blocks(c->h, c->buf, 1);
+
+	sha256_digest(c, bytes);
 	memset(ctx, -1, sizeof(*ctx));
 }
 
+#ifdef SHA2_SIMD
+/*
+ * The multi-buffer engines: one independent block per 32-bit lane, the
+ * state word j of all the lanes in s[j], and the schedule word t in w[t].
+ * SSE2 is part of x86-64; AVX2 is checked for at run time.
+ */
+#define ROTR_SSE2(v, c)							\
+	_mm_or_si128(_mm_srli_epi32(v, c), _mm_slli_epi32(v, 32 - (c)))
+
+/* 4 lanes. */
+static void sha256_block_x4(struct sha256 *const *c, const uint8_t *const *m)
+{
+	int i, j;
+	uint32_t h[4];
+	__m128i w[64], s[8], l[8], s0, s1, ch, t0, t1;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = _mm_set_epi32(sha256_load32(m[3] + 4 * i),
+				     sha256_load32(m[2] + 4 * i),
+				     sha256_load32(m[1] + 4 * i),
+				     sha256_load32(m[0] + 4 * i));
+
+	for (i = 16; i < 64; ++i) {
+		s0 = _mm_xor_si128(ROTR_SSE2(w[i - 15], 7),
+				   ROTR_SSE2(w[i - 15], 18));
+		s0 = _mm_xor_si128(s0, _mm_srli_epi32(w[i - 15], 3));
+
+		s1 = _mm_xor_si128(ROTR_SSE2(w[i - 2], 17),
+				   ROTR_SSE2(w[i - 2], 19));
+		s1 = _mm_xor_si128(s1, _mm_srli_epi32(w[i - 2], 10));
+
+		w[i] = _mm_add_epi32(_mm_add_epi32(w[i - 16], s0),
+				     _mm_add_epi32(w[i - 7], s1));
+	}
+
+	for (j = 0; j < 8; ++j)
+		s[j] = l[j] = _mm_set_epi32(c[3]->h[j], c[2]->h[j],
+					    c[1]->h[j], c[0]->h[j]);
+
+	for (i = 0; i < 64; ++i) {
+		s1 = _mm_xor_si128(ROTR_SSE2(l[4], 6), ROTR_SSE2(l[4], 11));
+		s1 = _mm_xor_si128(s1, ROTR_SSE2(l[4], 25));
+		ch = _mm_xor_si128(_mm_and_si128(l[4], l[5]),
+				   _mm_andnot_si128(l[4], l[6]));
+		t0 = _mm_add_epi32(_mm_add_epi32(l[7], s1),
+				   _mm_add_epi32(ch, w[i]));
+		t0 = _mm_add_epi32(t0, _mm_set1_epi32(sha256_rk[i]));
+
+		s0 = _mm_xor_si128(ROTR_SSE2(l[0], 2), ROTR_SSE2(l[0], 13));
+		s0 = _mm_xor_si128(s0, ROTR_SSE2(l[0], 22));
+		ch = _mm_xor_si128(_mm_and_si128(l[0], l[1]),
+				   _mm_and_si128(l[0], l[2]));
+		ch = _mm_xor_si128(ch, _mm_and_si128(l[1], l[2]));
+		t1 = _mm_add_epi32(s0, ch);
+
+		l[7] = l[6];
+		l[6] = l[5];
+		l[5] = l[4];
+		l[4] = _mm_add_epi32(l[3], t0);
+		l[3] = l[2];
+		l[2] = l[1];
+		l[1] = l[0];
+		l[0] = _mm_add_epi32(t0, t1);
+	}
+
+	/* A lane may repeat another; it then stores the same values. */
+	for (j = 0; j < 8; ++j) {
+		_mm_storeu_si128((__m128i *)h, _mm_add_epi32(s[j], l[j]));
+		for (i = 0; i < 4; ++i)
+			c[i]->h[j] = h[i];
+	}
+}
+
+#define ROTR_AVX2(v, c)							\
+	_mm256_or_si256(_mm256_srli_epi32(v, c),			\
+			_mm256_slli_epi32(v, 32 - (c)))
 
+/* 8 lanes. */
+__attribute__((target("avx2")))
+static void sha256_block_x8(struct sha256 *const *c, const uint8_t *const *m)
+{
+	int i, j;
+	uint32_t h[8];
+	__m256i w[64], s[8], l[8], s0, s1, ch, t0, t1;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = _mm256_set_epi32(sha256_load32(m[7] + 4 * i),
+					sha256_load32(m[6] + 4 * i),
+					sha256_load32(m[5] + 4 * i),
+					sha256_load32(m[4] + 4 * i),
+					sha256_load32(m[3] + 4 * i),
+					sha256_load32(m[2] + 4 * i),
+					sha256_load32(m[1] + 4 * i),
+					sha256_load32(m[0] + 4 * i));
 
+	for (i = 16; i < 64; ++i) {
+		s0 = _mm256_xor_si256(ROTR_AVX2(w[i - 15], 7),
+				      ROTR_AVX2(w[i - 15], 18));
+		s0 = _mm256_xor_si256(s0, _mm256_srli_epi32(w[i - 15], 3));
 
+		s1 = _mm256_xor_si256(ROTR_AVX2(w[i - 2], 17),
+				      ROTR_AVX2(w[i - 2], 19));
+		s1 = _mm256_xor_si256(s1, _mm256_srli_epi32(w[i - 2], 10));
 
+		w[i] = _mm256_add_epi32(_mm256_add_epi32(w[i - 16], s0),
+					_mm256_add_epi32(w[i - 7], s1));
+	}
 
+	for (j = 0; j < 8; ++j)
+		s[j] = l[j] = _mm256_set_epi32(c[7]->h[j], c[6]->h[j],
+					       c[5]->h[j], c[4]->h[j],
+					       c[3]->h[j], c[2]->h[j],
+					       c[1]->h[j], c[0]->h[j]);
 
+	for (i = 0; i < 64; ++i) {
+		s1 = _mm256_xor_si256(ROTR_AVX2(l[4], 6),
+				      ROTR_AVX2(l[4], 11));
+		s1 = _mm256_xor_si256(s1, ROTR_AVX2(l[4], 25));
+		ch = _mm256_xor_si256(_mm256_and_si256(l[4], l[5]),
+				      _mm256_andnot_si256(l[4], l[6]));
+		t0 = _mm256_add_epi32(_mm256_add_epi32(l[7], s1),
+				      _mm256_add_epi32(ch, w[i]));
+		t0 = _mm256_add_epi32(t0, _mm256_set1_epi32(sha256_rk[i]));
+
+		s0 = _mm256_xor_si256(ROTR_AVX2(l[0], 2),
+				      ROTR_AVX2(l[0], 13));
+		s0 = _mm256_xor_si256(s0, ROTR_AVX2(l[0], 22));
+		ch = _mm256_xor_si256(_mm256_and_si256(l[0], l[1]),
+				      _mm256_and_si256(l[0], l[2]));
+		ch = _mm256_xor_si256(ch, _mm256_and_si256(l[1], l[2]));
+		t1 = _mm256_add_epi32(s0, ch);
+
+		l[7] = l[6];
+		l[6] = l[5];
+		l[5] = l[4];
+		l[4] = _mm256_add_epi32(l[3], t0);
+		l[3] = l[2];
+		l[2] = l[1];
+		l[1] = l[0];
+		l[0] = _mm256_add_epi32(t0, t1);
+	}
 
+	for (j = 0; j < 8; ++j) {
+		_mm256_storeu_si256((__m256i *)h,
+				    _mm256_add_epi32(s[j], l[j]));
+		for (i = 0; i < 8; ++i)
+			c[i]->h[j] = h[i];
+	}
+}
+#endif
+
+/*
+ * Compress one block m[i] into each c[i], for n <= SHA256_MB_LANES. The
+ * vector engines get their unused lanes filled with copies of lane 0.
+ */
+static void sha256_block_mb(struct sha256 **c, const uint8_t **m, int n)
+{
+	int i;
+
+	assert(n > 0 && n <= SHA256_MB_LANES);
+
+#ifdef SHA2_SIMD
+	/* SHA-NI on one block at a time outruns the lanes. */
+	if (sha256_blocks == sha256_blocks_shani) {
+		for (i = 0; i < n; ++i)
+			sha256_blocks(c[i]->h, m[i], 1);
+		return;
+	}
+
+	if (n > 4 && __builtin_cpu_supports("avx2")) {
+		for (i = n; i < 8; ++i) {
+			c[i] = c[0];
+			m[i] = m[0];
+		}
+		sha256_block_x8(c, m);
+		return;
+	}
+
+	for (; n > 1; n -= 4, c += 4, m += 4) {
+		for (i = n; i < 4; ++i) {
+			c[i] = c[0];
+			m[i] = m[0];
+		}
+		sha256_block_x4(c, m);
+	}
+	if (n <= 0)
+		return;
+#endif
+	for (i = 0; i < n; ++i)
+		sha256_blocks(c[i]->h, m[i], 1);
+}
+
+/*
+ * Each round takes the next full block of every stream, from its buffer
+ * or straight from its input, and compresses them all at once. Whatever
+ * does not fill a block is left in the buffer.
+ */
+static void sha256_update_lanes(struct sha256 **c, const uint8_t **in,
+				size_t *len, int n)
+{
+	int i, nl;
+	size_t k;
+	struct sha256 *lc[SHA256_MB_LANES];
+	const uint8_t *lm[SHA256_MB_LANES];
+
+	for (;;) {
+		for (i = 0, nl = 0; i < n; ++i) {
+			if (c[i]->nbytes || len[i] < SHA256_BLOCK_LEN) {
+				k = SHA256_BLOCK_LEN - c[i]->nbytes;
+				k = k < len[i] ? k : len[i];
+				memcpy(c[i]->buf + c[i]->nbytes, in[i], k);
+				c[i]->nbytes += k;
+				in[i] += k;
+				len[i] -= k;
+				if (c[i]->nbytes < SHA256_BLOCK_LEN)
+					continue;
+				c[i]->nbytes = 0;
+				lm[nl] = c[i]->buf;
+			} else {
+				lm[nl] = in[i];
+				in[i] += SHA256_BLOCK_LEN;
+				len[i] -= SHA256_BLOCK_LEN;
+			}
+			sha256_count(c[i], 1);
+			lc[nl++] = c[i];
+		}
+		if (nl == 0)
+			break;
+		sha256_block_mb(lc, lm, nl);
+	}
+}
+
+void sha256_update_mb(struct sha256_ctx *const *ctx,
+		      const void *const *bytes, const size_t *len, int n)
+{
+	int i, j, k;
+	size_t l[SHA256_MB_LANES];
+	struct sha256 *c[SHA256_MB_LANES];
+	const uint8_t *in[SHA256_MB_LANES];
+
+	assert(ctx);
+	assert(bytes);
+	assert(len);
+
+	for (i = 0; i < n; i += k) {
+		k = n - i < SHA256_MB_LANES ? n - i : SHA256_MB_LANES;
+		for (j = 0; j < k; ++j) {
+			c[j] = (struct sha256 *)ctx[i + j];
+			in[j] = bytes[i + j];
+			l[j] = len[i + j];
+			assert(c[j]);
+			assert(l[j] == 0 || in[j]);
+		}
+		sha256_update_lanes(c, in, l, k);
+	}
+}
+
+void sha256_final_mb(struct sha256_ctx *const *ctx, uint8_t *const *bytes,
+		     int n)
+{
+	int i, j, k;
+	size_t l[SHA256_MB_LANES];
+	uint8_t pad[SHA256_MB_LANES][2 * SHA256_BLOCK_LEN];
+	struct sha256 *c[SHA256_MB_LANES];
+	const uint8_t *in[SHA256_MB_LANES];
+
+	assert(ctx);
+	assert(bytes);
+
+	for (i = 0; i < n; i += k) {
+		k = n - i < SHA256_MB_LANES ? n - i : SHA256_MB_LANES;
+		for (j = 0; j < k; ++j) {
+			c[j] = (struct sha256 *)ctx[i + j];
+			assert(c[j]);
+			assert(bytes[i + j]);
+			l[j] = sha256_pad(c[j], pad[j]);
+			in[j] = pad[j];
+		}
+		sha256_update_lanes(c, in, l, k);
+		for (j = 0; j < k; ++j) {
+			assert(c[j]->nbytes == 0);
+			sha256_digest(c[j], bytes[i + j]);
+			memset(c[j], -1, sizeof(*c[j]));
+		}
+	}
+}
 
 void sha512_init(struct sha512_ctx *ctx)
 {
@@ -256,139 +693,156 @@ static uint64_t ror64(uint64_t v, int c)
 	return (v >> c) | (v << (64 - c));
 }
 
-static void sha512_block(struct sha512 *c)
+static uint64_t sha512_load64(const uint8_t *m)
 {
-	int i;
-	uint64_t s0, s1, ch, t0, t1;
-	uint64_t lh[8];
-	static uint64_t w[80];
-
-	for (i = 0; i < SHA512_BLOCK_LEN; i += sizeof(uint64_t))
-		w[i >> 3] = htobe64(*(uint64_t *)(c->buf + i));
+	uint64_t v;
 
-	for (i = 16; i < 80; ++i) {
-		s0 = 0;
-		s0 ^= ror64(w[i - 15], 1);
-		s0 ^= ror64(w[i - 15], 8);
-		s0 ^= w[i - 15] >> 7;
+	memcpy(&v, m, sizeof(v));
+	return be64toh(v);
+}
 
-		s1 = 0;
-		s1 ^= ror64(w[i - 2], 19);
-		s1 ^= ror64(w[i - 2], 61);
-		s1 ^= w[i - 2] >> 6;
+/* As sha256_blocks_generic, for the n 128-byte blocks at p. */
+static void sha512_blocks(uint64_t *h, const uint8_t *p, size_t n)
+{
+	int i;
+	uint64_t s0, s1, ch, t0, t1;
+	uint64_t lh[8], hh[8];
+	uint64_t w[80];
+
+	memcpy(hh, h, sizeof(hh));
+	for (; n; --n, p += SHA512_BLOCK_LEN) {
+		for (i = 0; i < SHA512_BLOCK_LEN; i += sizeof(uint64_t))
+			w[i >> 3] = sha512_load64(p + i);
+
+		for (i = 16; i < 80; ++i) {
+			s0 = 0;
+			s0 ^= ror64(w[i - 15], 1);
+			s0 ^= ror64(w[i - 15], 8);
+			s0 ^= w[i - 15] >> 7;
+
+			s1 = 0;
+			s1 ^= ror64(w[i - 2], 19);
+			s1 ^= ror64(w[i - 2], 61);
+			s1 ^= w[i - 2] >> 6;
+
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		memcpy(lh, hh, sizeof(hh));
+		for (i = 0; i < 80; ++i) {
+			s1 = 0;
+			s1 ^= ror64(lh[4], 14);
+			s1 ^= ror64(lh[4], 18);
+			s1 ^= ror64(lh[4], 41);
+
+			ch = 0;
+			ch ^= lh[4] & lh[5];
+			ch ^= (~lh[4]) & lh[6];
+			t0 = lh[7] + s1 + ch + sha512_rk[i] + w[i];
+
+			s0 = 0;
+			s0 ^= ror64(lh[0], 28);
+			s0 ^= ror64(lh[0], 34);
+			s0 ^= ror64(lh[0], 39);
+
+			ch = 0;
+			ch ^= lh[0] & lh[1];
+			ch ^= lh[0] & lh[2];
+			ch ^= lh[1] & lh[2];
+			t1 = s0 + ch;
+
+			lh[7] = lh[6];
+			lh[6] = lh[5];
+			lh[5] = lh[4];
+			lh[4] = lh[3] + t0;
+			lh[3] = lh[2];
+			lh[2] = lh[1];
+			lh[1] = lh[0];
+			lh[0] = t0 + t1;
+		}
 
-		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
-	}
-	memcpy(lh, c->h, sizeof(c->h));
-	for (i = 0; i < 80; ++i) {
-		s1 = 0;
-		s1 ^= ror64(lh[4], 14);
-		s1 ^= ror64(lh[4], 18);
-		s1 ^= ror64(lh[4], 41);
-
-		ch = 0;
-		ch ^= lh[4] & lh[5];
-		ch ^= (~lh[4]) & lh[6];
-		t0 = lh[7] + s1 + ch + sha512_rk[i] + w[i];
-
-		s0 = 0;
-		s0 ^= ror64(lh[0], 28);
-		s0 ^= ror64(lh[0], 34);
-		s0 ^= ror64(lh[0], 39);
-
-		ch = 0;
-		ch ^= lh[0] & lh[1];
-		ch ^= lh[0] & lh[2];
-		ch ^= lh[1] & lh[2];
-		t1 = s0 + ch;
-
-		lh[7] = lh[6];
-		lh[6] = lh[5];
-		lh[5] = lh[4];
-		lh[4] = lh[3] + t0;
-		lh[3] = lh[2];
-		lh[2] = lh[1];
-		lh[1] = lh[0];
-		lh[0] = t0 + t1;
+		for (i = 0; i < 8; ++i)
+			hh[i] += lh[i];
 	}
-
-	for (i = 0; i < 8; ++i)
-		c->h[i] += lh[i];
+	memcpy(h, hh, sizeof(hh));
 
 	/* TODO secure. */
 	memset(w, -1, sizeof(w));
 }
 
-void sha512_update(struct sha512_ctx *ctx, const void *bytes, int len)
+static void sha512_count(struct sha512 *c, size_t n)
+{
+	c->nwords += n;
+	/* Overflow. */
+	assert(c->nwords >= n);
+}
+
+void sha512_update(struct sha512_ctx *ctx, const void *bytes, size_t len)
 {
 	struct sha512 *c = (struct sha512 *)ctx;
-	int diff, n, src;
-	const char *in;
+	size_t diff, n;
+	const uint8_t *in;
 
 	assert(c != NULL);
-	assert(len >= 0);
 	if (len == 0)
 		return;
 	assert(bytes);
 
 	in = bytes;
-	src = 0;
-	for (; len;) {
+	if (c->nbytes) {
 		diff = SHA512_BLOCK_LEN - c->nbytes;
 		n = diff < len ? diff : len;
-		memcpy(c->buf + c->nbytes, in + src, n);
+		memcpy(c->buf + c->nbytes, in, n);
 		c->nbytes += n;
-		src += n;
+		in += n;
 		len -= n;
 
-		if (c->nbytes == SHA512_BLOCK_LEN) {
-			c->nbytes = 0;
-			++c->nwords;
-			/* Overflow. */
-			assert(c->nwords != 0);
-			sha512_block(c);
-		}
+		if (c->nbytes < SHA512_BLOCK_LEN)
+			return;
+		c->nbytes = 0;
+		sha512_count(c, 1);
+		sha512_blocks(c->h, c->buf, 1);
+	}
+
+	n = len / SHA512_BLOCK_LEN;
+	if (n) {
+		sha512_count(c, n);
+		sha512_blocks(c->h, in, n);
+		in += n * SHA512_BLOCK_LEN;
+		len -= n * SHA512_BLOCK_LEN;
 	}
+
+	memcpy(c->buf, in, len);
+	c->nbytes = len;
 }
 
 void sha512_final(struct sha512_ctx *ctx, uint8_t *bytes)
 {
 	struct sha512 *c = (struct sha512 *)ctx;
 	int i, j;
-	uint8_t byte;
-	uint64_t nbits, k, mask, len;
+	uint64_t nbits, hi;
 
 	assert(c != NULL);
 	assert(bytes);
 
+	/* The length in bits, hi:nbits. */
+	hi = htobe64(c->nwords >> 54);
 	nbits   = c->nwords;
 	nbits <<= 10;
 	nbits  += c->nbytes << 3;
-	len = htobe64(nbits);
-	nbits += 1;	/* Append a single bit 1. */
-	nbits += 128;	/* 128 == size of the size of the message. */
-
-	mask = ((uint64_t)1 << 10) - 1;
-	k = nbits & mask;
-	assert(k);
-	k = 1024 - k;	/* # of zeroes to append. */
-
-	byte = 0x80;
-	if (k) {
-		assert(k >= 7);
-		sha512_update(ctx, &byte, 1);
-		k -= 7;
-	}
-
-	byte = 0;
-	while (k) {
-		sha512_update(ctx, &byte, 1);
-		k -= 8;
+	nbits = htobe64(nbits);
+
+	/* As in sha256_final, with a 16-byte length. */
+	c->buf[c->nbytes++] = 0x80;
+	if (c->nbytes > SHA512_BLOCK_LEN - 16) {
+		memset(c->buf + c->nbytes, 0, SHA512_BLOCK_LEN - c->nbytes);
+		sha512_blocks(c->h, c->buf, 1);
+		c->nbytes = 0;
 	}
+	memset(c->buf + c->nbytes, 0, SHA512_BLOCK_LEN - 16 - c->nbytes);
+	memcpy(c->buf + SHA512_BLOCK_LEN - 16, &hi, 8);
+	memcpy(c->buf + SHA512_BLOCK_LEN - 8, &nbits, 8);
+	sha512_blocks(c->h, c->buf, 1);
 
-	/* We do not support the full 128-bit message length. */
-	sha512_update(ctx, &k, sizeof(k));
-	sha512_update(ctx, &len, sizeof(len));
 	for (i = 0; i < SHA512_DIGEST_LEN; i += 8) {
 		j = i >> 3;
 		bytes[i + 0] = (c->h[j] >> 56) & 0xff;
@@ -402,3 +856,90 @@ void sha512_final(struct sha512_ctx *ctx, uint8_t *bytes)
 	}
 	memset(ctx, -1, sizeof(*ctx));
 }
+
+/*
+ * Map the regular file at path. The kernel is told that it will be read
+ * once, front to back, so that it reads ahead and drops the pages behind.
+ * An empty file is not mapped; *p is then NULL.
+ */
+static int sha2_map(const char *path, const void **p, size_t *len)
+{
+	int fd, ret, err;
+	void *m;
+	struct stat st;
+
+	assert(path);
+
+	*p = NULL;
+	*len = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = fstat(fd, &st);
+	if (ret == 0 && !S_ISREG(st.st_mode)) {
+		errno = EINVAL;
+		ret = -1;
+	}
+	if (ret == 0 && (uintmax_t)st.st_size > SIZE_MAX) {
+		errno = EFBIG;
+		ret = -1;
+	}
+
+	if (ret == 0 && st.st_size) {
+		m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m == MAP_FAILED) {
+			ret = -1;
+		} else {
+			posix_madvise(m, st.st_size, POSIX_MADV_SEQUENTIAL);
+			*p = m;
+			*len = st.st_size;
+		}
+	}
+
+	err = errno;
+	close(fd);
+	errno = err;
+	return ret;
+}
+
+static void sha2_unmap(const void *p, size_t len)
+{
+	if (p)
+		munmap((void *)p, len);
+}
+
+int sha256_file(const char *path, uint8_t *bytes)
+{
+	size_t len;
+	const void *p;
+	struct sha256_ctx ctx;
+
+	assert(bytes);
+
+	if (sha2_map(path, &p, &len))
+		return -1;
+	sha256_init(&ctx);
+	sha256_update(&ctx, p, len);
+	sha256_final(&ctx, bytes);
+	sha2_unmap(p, len);
+	return 0;
+}
+
+int sha512_file(const char *path, uint8_t *bytes)
+{
+	size_t len;
+	const void *p;
+	struct sha512_ctx ctx;
+
+	assert(bytes);
+
+	if (sha2_map(path, &p, &len))
+		return -1;
+	sha512_init(&ctx);
+	sha512_update(&ctx, p, len);
+	sha512_final(&ctx, bytes);
+	sha2_unmap(p, len);
+	return 0;
+}
@@ -19,6 +19,7 @@
 #include <ec.h>
 #include <rndm.h>
 #include <sha2.h>
+#include <hmac.h>
 #include <hkdf.h>
 #include <chacha.h>
 #include <aead.h>
@@ -33,13 +34,14 @@ static const char *pub_str	=
 "671e3b404cd8512b5077822a2e7764d614cdda6f67d3c6433ce63d5bcb132b7d";
 */
 
-static void tls_hkdf_expand_label(uint8_t *out, int olen, const void *secret,
+static void tls_hkdf_expand_label(uint8_t *out, int olen,
+				  const struct hmac_sha256_key *secret,
 				  const char *label, const void *thash)
 {
 	int i, n;
 	uint16_t len;
 	uint8_t len8;
-	static uint8_t info[514];
+	uint8_t info[514];
 
 	/*
 	 * Store 1-byte lengths in a uint8_t.
@@ -72,19 +74,21 @@ static void tls_hkdf_expand_label(uint8_t *out, int olen, const void *secret,
 	i += len8;
 
 	len = i;
-	hkdf_sha256_expand(out, olen, secret, SHA256_DIGEST_LEN, info, len);
+	hkdf_sha256_expand_key(out, olen, secret, info, len);
 }
 
 /*
  * Derive-Secret's secret is the output of HKDF-extract. The size ==
- * size of the output of the hash function.
+ * size of the output of the hash function. It is passed as an HMAC key,
+ * so that the secrets that derive more than one value set it up once.
  *
  * thash == Transcript Hash. Its size == size of the Hash function's
  * output.
  *
  * out's size is also the same.
  */
-static void tls_derive_secret(uint8_t *out, const void *secret,
+static void tls_derive_secret(uint8_t *out,
+			      const struct hmac_sha256_key *secret,
 			      const char *label, const void *thash)
 {
 	tls_hkdf_expand_label(out, SHA256_DIGEST_LEN, secret, label, thash);
@@ -410,6 +414,7 @@ struct tls_ctx *tls_ctx_new()
 #endif
 
 	priv = bn_new_from_string_be(priv_str, 16);
+	bn_set_secret(priv);
 	ctx->secrets.priv = bn_to_bytes_le(priv, &n);
 	assert(n == 32);
 
@@ -435,14 +440,17 @@ struct tls_ctx *tls_ctx_new()
 static void tls_derive_next_secret(uint8_t *out, const uint8_t *empty,
 				   const uint8_t *prev, const uint8_t *ikm)
 {
-	static uint8_t salt[SHA256_DIGEST_LEN];
-	static uint8_t zeroes[SHA256_DIGEST_LEN];
+	uint8_t salt[SHA256_DIGEST_LEN];
+	uint8_t zeroes[SHA256_DIGEST_LEN];
+	struct hmac_sha256_key key;
 
 	/*
 	 * Salt for the next extract. Transcript sent is empty. So thash is the
 	 * hash of the empty string. The result can be used as it is.
 	 */
-	tls_derive_secret(salt, prev, "derived", empty);
+	hmac_sha256_key_init(&key, prev, SHA256_DIGEST_LEN);
+	tls_derive_secret(salt, &key, "derived", empty);
+	hmac_sha256_key_fini(&key);
 
 	/* Next Secret. Can be used as it is. */
 	if (ikm == NULL) {
@@ -454,39 +462,47 @@ static void tls_derive_next_secret(uint8_t *out, const uint8_t *empty,
 }
 
 static void tls_derive_traffic_ikm(uint8_t *t, uint8_t *tkey, uint8_t *tiv,
-			      const uint8_t *secret, const char *label,
-			      const uint8_t *thash)
+			      const struct hmac_sha256_key *secret,
+			      const char *label, const uint8_t *thash)
 {
+	struct hmac_sha256_key key;
+
 	tls_derive_secret(t, secret, label, thash);
-	tls_hkdf_expand_label(tkey, 32, t, "key", NULL);
-	tls_hkdf_expand_label(tiv, 12, t, "iv", NULL);
+	hmac_sha256_key_init(&key, t, SHA256_DIGEST_LEN);
+	tls_hkdf_expand_label(tkey, 32, &key, "key", NULL);
+	tls_hkdf_expand_label(tiv, 12, &key, "iv", NULL);
+	hmac_sha256_key_fini(&key);
 }
 
 static void tls_derive_master_secrets(struct tls_ctx *ctx)
 {
-	static struct sha256_ctx hctx;
+	struct sha256_ctx hctx;
+	struct hmac_sha256_key key;
 
 	hctx = ctx->transcript.hctx;
 	sha256_final(&hctx, ctx->transcript.sfin);
 
 	tls_derive_next_secret(ctx->secrets.master, ctx->transcript.empty,
 			       ctx->secrets.hand, NULL);
+	hmac_sha256_key_init(&key, ctx->secrets.master, SHA256_DIGEST_LEN);
 	tls_derive_traffic_ikm(ctx->secrets.app_traffic[TLS_CLIENT],
 			       ctx->secrets.app_traffic_key[TLS_CLIENT],
 			       ctx->secrets.app_traffic_iv[TLS_CLIENT],
-			       ctx->secrets.master, "c ap traffic",
+			       &key, "c ap traffic",
 			       ctx->transcript.sfin);
 	tls_derive_traffic_ikm(ctx->secrets.app_traffic[TLS_SERVER],
 			       ctx->secrets.app_traffic_key[TLS_SERVER],
 			       ctx->secrets.app_traffic_iv[TLS_SERVER],
-			       ctx->secrets.master, "s ap traffic",
+			       &key, "s ap traffic",
 			       ctx->transcript.sfin);
+	hmac_sha256_key_fini(&key);
 }
 
 static void tls_derive_handshake_secrets(struct tls_ctx *ctx)
 {
 	int sz;
-	static struct sha256_ctx hctx;
+	struct sha256_ctx hctx;
+	struct hmac_sha256_key key;
 	struct ec_mont *ec;
 	struct ec_point *pub;
 	struct bn *t, *priv;
@@ -501,6 +517,7 @@ static void tls_derive_handshake_secrets(struct tls_ctx *ctx)
 
 	ec = ec_new_montgomery(&emp);
 	priv = bn_new_from_bytes_le(ctx->secrets.priv, 32);
+	bn_set_secret(priv);
 
 	/*
 	 * Server's x25519 key share arrives in the little-endian byte-array
@@ -512,6 +529,7 @@ static void tls_derive_handshake_secrets(struct tls_ctx *ctx)
 	bn_free(priv);
 	bn_free(t);
 	t = ecm_point_x(ec, pub);
+	bn_set_secret(t);
 
 	/*
 	 * Shared secret needs to be converted to little-endian byte-array
@@ -528,22 +546,24 @@ static void tls_derive_handshake_secrets(struct tls_ctx *ctx)
 
 	tls_derive_next_secret(ctx->secrets.hand, ctx->transcript.empty,
 			       ctx->secrets.early, ctx->secrets.shared);
+	hmac_sha256_key_init(&key, ctx->secrets.hand, SHA256_DIGEST_LEN);
 	tls_derive_traffic_ikm(ctx->secrets.hand_traffic[TLS_CLIENT],
 			       ctx->secrets.hand_traffic_key[TLS_CLIENT],
 			       ctx->secrets.hand_traffic_iv[TLS_CLIENT],
-			       ctx->secrets.hand, "c hs traffic",
+			       &key, "c hs traffic",
 			       ctx->transcript.shello);
 	tls_derive_traffic_ikm(ctx->secrets.hand_traffic[TLS_SERVER],
 			       ctx->secrets.hand_traffic_key[TLS_SERVER],
 			       ctx->secrets.hand_traffic_iv[TLS_SERVER],
-			       ctx->secrets.hand, "s hs traffic",
+			       &key, "s hs traffic",
 			       ctx->transcript.shello);
+	hmac_sha256_key_fini(&key);
 }
 
 static void tls_derive_early_secrets(struct tls_ctx *ctx)
 {
-	static struct sha256_ctx hctx;
-	static uint8_t zeroes[SHA256_DIGEST_LEN];
+	struct sha256_ctx hctx;
+	uint8_t zeroes[SHA256_DIGEST_LEN];
 
 	hctx = ctx->transcript.hctx;
 	sha256_final(&hctx, ctx->transcript.chello);
@@ -579,6 +599,8 @@ static int tls_decipher_handshake(struct tls_ctx *ctx, void *rec, int len)
 	len -= sz;
 	sz = aead_dec(ctx->secrets.hand_traffic_key[other], iv,
 		      out, len, rec, sz, out);
+	/* Bad tag. */
+	assert(sz >= 0);
 
 	/* TLSInnerPlainText. Skip zeroes. */
 	for (i = sz - 1; i >= 0; --i)